@@ -2,152 +2,388 @@
 #include <cerrno>
 #include <cassert>
 #include <cstdlib>
+#include <cctype>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 #include <iconv.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define I_ACKNOWLEDGE_THAT_NATUS_IS_NOT_STABLE
-#include <natus/natus.hpp>
-using namespace natus;
+#include "bincommon.hpp"
+#include "iocommon.hpp"
+#include "hash.hpp"
+using namespace std;
 
 #define OK(x) ok = (!x.isException()) || ok
 #define NCONST(macro) OK(base.setRecursive("exports." # macro, (long) macro))
 #define NFUNC(func) OK(base.setRecursive("exports." # func, posix_ ## func))
 
-#define PRIV_BINARY_BUFFER "commonjs::binary"
+#define ICONV_CACHE_MAX 4
 
-static Value convert(Value ctx, const char *from, const char *to, size_t srclen, const unsigned char* srcbuf, size_t* dstlen, unsigned char** dstbuf) {
-	iconv_t state = iconv_open(from, to);
-	if (state < 0) return throwException(ctx, errno);
-
-	*dstbuf = NULL;
-	*dstlen = 0;
-	size_t chars = -1, bytesin = srclen, bytesout = 0;
-	char *tmpsrc, *tmpdst;
-	errno = E2BIG;
-	do {
-		if (errno != E2BIG) break;
-
-		// Reallocate the buffer
-		*dstlen += bytesin;
-		unsigned char *tmp = (unsigned char*) realloc(*dstbuf, *dstlen);
-		if (!tmp) break;
-		*dstbuf = tmp;
+#define PRIV_BINARY_HASHER "commonjs::binary::hasher"
+
+// Open iconv descriptors are cached per (from, to) pair since iconv_open()
+// is far more expensive than converting a typical payload
+typedef pair<string, string> CharsetPair;
+static map<CharsetPair, vector<iconv_t> > iconv_cache;
+static pthread_mutex_t iconv_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static iconv_t iconv_acquire(const char *from, const char *to) {
+	pthread_mutex_lock(&iconv_cache_lock);
+	vector<iconv_t>& pool = iconv_cache[CharsetPair(from, to)];
+	if (!pool.empty()) {
+		iconv_t state = pool.back();
+		pool.pop_back();
+		pthread_mutex_unlock(&iconv_cache_lock);
+		return state;
+	}
+	pthread_mutex_unlock(&iconv_cache_lock);
+
+	return iconv_open(to, from);
+}
 
-		// Reset the state
-		tmpsrc = (char*)  srcbuf;
-		tmpdst = (char*) *dstbuf;
-		bytesin  =  srclen;
-		bytesout = *dstlen;
-		iconv(state, NULL, NULL, NULL, NULL);
-	} while ((chars = iconv(state, &tmpsrc, &bytesin, &tmpdst, &bytesout)) < 0);
-	iconv_close(state);
+static void iconv_release(const char *from, const char *to, iconv_t state) {
+	iconv(state, NULL, NULL, NULL, NULL); // Reset the shift state
 
-	// If we have an unrecoverable error, throw it
-	if (chars < 0) {
-		free(*dstbuf);
-		return throwException(ctx, errno);
+	pthread_mutex_lock(&iconv_cache_lock);
+	vector<iconv_t>& pool = iconv_cache[CharsetPair(from, to)];
+	if (pool.size() < ICONV_CACHE_MAX) {
+		pool.push_back(state);
+		state = (iconv_t) -1;
 	}
+	pthread_mutex_unlock(&iconv_cache_lock);
+
+	if (state != (iconv_t) -1)
+		iconv_close(state);
+}
+
+// Charsets we transcode natively; everything else goes through iconv
+enum Charset {
+	CHARSET_OTHER,
+	CHARSET_ASCII,
+	CHARSET_LATIN1,
+	CHARSET_UTF8,
+	CHARSET_UTF16LE,
+	CHARSET_UTF16BE
+};
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN true
+#define CHARSET_UTF16NATIVE CHARSET_UTF16BE
+#else
+#define HOST_BIG_ENDIAN false
+#define CHARSET_UTF16NATIVE CHARSET_UTF16LE
+#endif
+
+#define CHARSET_IS_UTF16(cs) ((cs) == CHARSET_UTF16LE || (cs) == CHARSET_UTF16BE)
+
+static Charset charset_lookup(const char *name) {
+	char   norm[16];
+	size_t len = 0;
+
+	// Compare case-insensitively, ignoring '-' and '_'
+	for ( ; *name && len < sizeof(norm) - 1 ; name++)
+		if (*name != '-' && *name != '_')
+			norm[len++] = toupper(*name);
+	if (*name) return CHARSET_OTHER;
+	norm[len] = '\0';
 
-	*dstlen -= bytesout; // Decrease the length by the amount of buffer not filled
-	Value undef = ctx.newUndefined();
-	if (undef.isException()) free(*dstbuf);
-	return undef;
+	if (!strcmp(norm, "ASCII")    || !strcmp(norm, "USASCII"))  return CHARSET_ASCII;
+	if (!strcmp(norm, "LATIN1")   || !strcmp(norm, "ISO88591")) return CHARSET_LATIN1;
+	if (!strcmp(norm, "UTF8"))                                  return CHARSET_UTF8;
+	if (!strcmp(norm, "UTF16LE"))                               return CHARSET_UTF16LE;
+	if (!strcmp(norm, "UTF16BE"))                               return CHARSET_UTF16BE;
+	if (!strcmp(norm, "UCS2INTERNAL"))                          return CHARSET_UTF16NATIVE;
+	return CHARSET_OTHER;
 }
 
-static void free_buffer(unsigned char *buf) {
-	delete[] buf;
+// Upper bound on the output size of transcode()
+static size_t charset_bound(Charset from, Charset to, size_t srclen) {
+	if (CHARSET_IS_UTF16(to))
+		return CHARSET_IS_UTF16(from) ? srclen : srclen * 2;
+	if (to == CHARSET_UTF8)
+		return CHARSET_IS_UTF16(from) ? srclen / 2 * 3 : from == CHARSET_LATIN1 ? srclen * 2 : srclen;
+	return CHARSET_IS_UTF16(from) ? srclen / 2 : srclen;
 }
 
-class BinaryStringClass : public Class {
-public:
-	virtual Class::Flags getFlags () {
-		return Class::FlagObject;
+// Returns the number of leading bytes below 0x80
+static size_t ascii_span(const unsigned char* buf, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	for ( ; i + 16 <= len ; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (buf + i)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+	for ( ; i + 8 <= len ; i += 8) {
+		uint64_t word;
+		memcpy(&word, buf + i, sizeof(word));
+		if (word & 0x8080808080808080ULL) break;
+	}
+	while (i < len && buf[i] < 0x80) i++;
+	return i;
+}
+
+// Copies an ASCII run, widening it to UTF-16 if required; returns bytes written
+static size_t ascii_store(Charset to, const unsigned char* src, size_t len, unsigned char* dst) {
+	if (!CHARSET_IS_UTF16(to)) {
+		memcpy(dst, src, len);
+		return len;
 	}
 
-	virtual Value del(Value& obj, Value& name) {
-		if (!name.isNumber()) return NULL;
-		return throwException(obj, "IndexError", "ByteStrings are immutable!");
+	size_t i = 0;
+	bool   be = to == CHARSET_UTF16BE;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for ( ; i + 16 <= len ; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_storeu_si128((__m128i*) (dst + i * 2),      be ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i*) (dst + i * 2 + 16), be ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero));
 	}
+#endif
+	for ( ; i < len ; i++) {
+		dst[i * 2 + !be] = 0;
+		dst[i * 2 +  be] = src[i];
+	}
+	return len * 2;
+}
 
-	virtual Value set(Value& obj, Value& name, Value& value) {
-		if (!name.isNumber()) return NULL;
-		return throwException(obj, "IndexError", "ByteStrings are immutable!");
+// Narrows a leading run of ASCII UTF-16 code units into dst; returns the units consumed
+static size_t ascii_narrow(Charset from, const unsigned char* src, size_t units, unsigned char* dst) {
+	size_t i  = 0;
+	bool   be = from == CHARSET_UTF16BE;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16(be ? 0x80FF : 0xFF80);
+	for ( ; i + 8 <= units ; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + i * 2));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), _mm_setzero_si128())) != 0xFFFF)
+			break;
+		if (be) v = _mm_srli_epi16(v, 8);
+		_mm_storel_epi64((__m128i*) (dst + i), _mm_packus_epi16(v, v));
 	}
+#endif
+	for ( ; i < units ; i++) {
+		if (src[i * 2 + !be] != 0 || src[i * 2 + be] >= 0x80) break;
+		dst[i] = src[i * 2 + be];
+	}
+	return i;
+}
+
+// Converts between two native charsets, validating as we go.
+// Returns 0 on success or an errno value matching what iconv would report.
+static int transcode(Charset from, Charset to, const unsigned char* src, size_t srclen, unsigned char* dst, size_t* dstlen) {
+	bool   wide = CHARSET_IS_UTF16(from);
+	size_t i = 0, o = 0;
+
+	while (i < srclen) {
+		// Move runs of ASCII across in bulk
+		if (!wide) {
+			size_t n = from == CHARSET_LATIN1 && to == CHARSET_LATIN1
+					? srclen - i
+					: ascii_span(src + i, srclen - i);
+			if (n > 0) {
+				o += ascii_store(to, src + i, n, dst + o);
+				i += n;
+				continue;
+			}
+		} else if (!CHARSET_IS_UTF16(to)) {
+			size_t n = ascii_narrow(from, src + i, (srclen - i) / 2, dst + o);
+			if (n > 0) {
+				o += n;
+				i += n * 2;
+				continue;
+			}
+		}
+
+		// Decode one code point
+		uint32_t cp;
+		switch (from) {
+			case CHARSET_ASCII:
+				cp = src[i++];
+				if (cp >= 0x80) return EILSEQ;
+				break;
+
+			case CHARSET_LATIN1:
+				cp = src[i++];
+				break;
+
+			case CHARSET_UTF8: {
+				size_t n;
+				cp = src[i];
+				if      (cp < 0x80) n = 1;
+				else if (cp < 0xC2) return EILSEQ; // Stray continuation or overlong
+				else if (cp < 0xE0) { n = 2; cp &= 0x1F; }
+				else if (cp < 0xF0) { n = 3; cp &= 0x0F; }
+				else if (cp < 0xF5) { n = 4; cp &= 0x07; }
+				else return EILSEQ;
 
-	virtual Value get(Value& obj, Value& name) {
-		if (!name.isNumber()) return NULL;
+				if (srclen - i < n) return EINVAL;
+				for (size_t k=1 ; k < n ; k++) {
+					if ((src[i + k] & 0xC0) != 0x80) return EILSEQ;
+					cp = (cp << 6) | (src[i + k] & 0x3F);
+				}
+				if (n == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) return EILSEQ;
+				if (n == 4 && (cp < 0x10000 || cp > 0x10FFFF))                return EILSEQ;
+				i += n;
+				break;
+			}
+
+			default: { // UTF-16
+				bool be = from == CHARSET_UTF16BE;
+				if (srclen - i < 2) return EINVAL;
+				cp = be ? (src[i] << 8 | src[i + 1]) : (src[i + 1] << 8 | src[i]);
+				i += 2;
+
+				if (cp >= 0xDC00 && cp <= 0xDFFF) return EILSEQ;
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					if (srclen - i < 2) return EINVAL;
+					uint32_t lo = be ? (src[i] << 8 | src[i + 1]) : (src[i + 1] << 8 | src[i]);
+					if (lo < 0xDC00 || lo > 0xDFFF) return EILSEQ;
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					i += 2;
+				}
+				break;
+			}
+		}
+
+		// Encode it
+		switch (to) {
+			case CHARSET_ASCII:
+				if (cp >= 0x80) return EILSEQ;
+				dst[o++] = cp;
+				break;
 
-		ssize_t idx = name.to<ssize_t>();
-		ssize_t len = obj.get("length").to<ssize_t>();
-		if (idx < 0) idx += len; // Convert -1 to (len-1)
-		if (idx < 0)    return throwException(obj, "IndexError", "Negative index is before the start of the array!");
-		if (idx >= len) return obj.newUndefined();
+			case CHARSET_LATIN1:
+				if (cp >= 0x100) return EILSEQ;
+				dst[o++] = cp;
+				break;
 
-		const unsigned char* tmp = obj.getPrivate<const unsigned char*>(PRIV_BINARY_BUFFER);
-		if (!tmp) return obj.newUndefined();
+			case CHARSET_UTF8:
+				if (cp < 0x80)
+					dst[o++] = cp;
+				else if (cp < 0x800) {
+					dst[o++] = 0xC0 | (cp >> 6);
+					dst[o++] = 0x80 | (cp & 0x3F);
+				} else if (cp < 0x10000) {
+					dst[o++] = 0xE0 | (cp >> 12);
+					dst[o++] = 0x80 | ((cp >> 6) & 0x3F);
+					dst[o++] = 0x80 | (cp & 0x3F);
+				} else {
+					dst[o++] = 0xF0 | (cp >> 18);
+					dst[o++] = 0x80 | ((cp >> 12) & 0x3F);
+					dst[o++] = 0x80 | ((cp >> 6) & 0x3F);
+					dst[o++] = 0x80 | (cp & 0x3F);
+				}
+				break;
 
-		return obj.newNumber(tmp[name.to<size_t>()]);
+			default: { // UTF-16
+				bool be = to == CHARSET_UTF16BE;
+				uint32_t units[2] = { cp, 0 };
+				size_t   count    = 1;
+				if (cp >= 0x10000) {
+					units[0] = 0xD800 + ((cp - 0x10000) >> 10);
+					units[1] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+					count    = 2;
+				}
+				for (size_t k=0 ; k < count ; k++, o += 2) {
+					dst[o +  be] = units[k] & 0xFF;
+					dst[o + !be] = units[k] >> 8;
+				}
+				break;
+			}
+		}
 	}
 
-	virtual Value enumerate(Value& obj) {
-		size_t len = obj.get("length").to<size_t>();
+	*dstlen = o;
+	return 0;
+}
 
-		Value items = obj.newArray();
-		for (size_t i=0 ; i < len ; i++)
-			arrayBuilder(items, (double) i);
+static Value convert(Value ctx, const char *from, const char *to, size_t srclen, const unsigned char* srcbuf, size_t* dstlen, unsigned char** dstbuf) {
+	// Common charsets are handled natively, without a trip through iconv
+	Charset fromcs = charset_lookup(from);
+	Charset tocs   = charset_lookup(to);
+	if (fromcs != CHARSET_OTHER && tocs != CHARSET_OTHER) {
+		unsigned char* buf = alloc_buffer(charset_bound(fromcs, tocs, srclen));
+		int error = transcode(fromcs, tocs, srcbuf, srclen, buf, dstlen);
+		if (error) {
+			free_buffer(buf);
+			return throwException(ctx, error);
+		}
 
-		return items;
+		*dstbuf = buf;
+		return ctx.newUndefined();
 	}
-};
 
-class BinaryArrayClass : public BinaryStringClass {
-public:
-	virtual Value del(Value& obj, Value& name) {
-		if (!name.isNumber()) return NULL;
-
-		ssize_t idx = name.to<ssize_t>();
-		ssize_t len = obj.get("length").to<ssize_t>();
-		if (idx < 0) idx += len; // Convert -1 to (len-1)
-		if (idx < 0) return throwException(obj, "IndexError", "Negative index is before the start of the array!");
-
-		unsigned char* buf = obj.getPrivate<unsigned char*>(PRIV_BINARY_BUFFER);
-		if (buf) memmove(buf+idx, buf+idx+1, len-idx-1);
-		return obj.newUndefined();
-	}
-
-	virtual Value set(Value& obj, Value& name, Value& value) {
-		if (!name.isNumber()) return NULL;
-
-		ssize_t idx = name.to<ssize_t>();
-		ssize_t val = value.to<size_t>();
-		ssize_t len = obj.get("length").to<ssize_t>();
-		if (idx < 0) idx += len; // Convert -1 to (len-1)
-		if (idx < 0)              return throwException(obj, "IndexError", "Negative index is before the start of the array!");
-		if (!value.isNumber())    return throwException(obj, "TypeError",  "Value must be a number!");
-		if (val < 0 || val > 255) return throwException(obj, "RangeError", "Byte values must be between 0 and 255 inclusive!");
-
-		// If the buffer doesn't exist or needs to be resized
-		unsigned char* buf = obj.getPrivate<unsigned char*>(PRIV_BINARY_BUFFER);
-		if (!buf || idx >= len) {
-			unsigned char* tmp = new unsigned char[idx+1];
-			memset(tmp, 0, idx+1);
-			if (buf) memcpy(tmp, buf, len);
-			if (!obj.setPrivate(PRIV_BINARY_BUFFER, tmp, (FreeFunction) free_buffer))
-				return obj.newUndefined();
-			buf = tmp;
-			len = idx+1;
-			obj.set("length", len, Value::PropAttrProtected);
+	iconv_t state = iconv_acquire(from, to);
+	if (state == (iconv_t) -1) return throwException(ctx, errno);
+
+	size_t         size = srclen + 16;
+	size_t         done = 0;
+	unsigned char* buf  = alloc_buffer(size);
+
+	char*  src      = (char*) srcbuf;
+	size_t bytesin  = srclen;
+	bool   flushing = false;
+	for (;;) {
+		char*  dst      = (char*) buf + done;
+		size_t bytesout = size - done;
+		size_t chars    = flushing
+				? iconv(state, NULL, NULL, &dst, &bytesout)
+				: iconv(state, &src, &bytesin, &dst, &bytesout);
+		done = dst - (char*) buf;
+
+		if (chars != (size_t) -1) {
+			if (flushing) break;
+			flushing = true; // Emit any trailing shift sequence
+			continue;
 		}
 
-		buf[idx] = val;
-		return obj.newUndefined();
+		// If we have an unrecoverable error, throw it
+		if (errno != E2BIG) {
+			int error = errno;
+			free_buffer(buf);
+			iconv_release(from, to, state);
+			return throwException(ctx, error);
+		}
+
+		// Out of room: grow the buffer and resume where iconv stopped
+		unsigned char* tmp = alloc_buffer(size * 2);
+		memcpy(tmp, buf, done);
+		free_buffer(buf);
+		buf   = tmp;
+		size *= 2;
 	}
-};
+	iconv_release(from, to, state);
+
+	*dstbuf = buf;
+	*dstlen = done;
+	return ctx.newUndefined();
+}
 
 static Value binary_Binary(Value& fnc, Value& ths, Value& arg) {
 	return throwException(fnc, "ValueError", "Binary is abstract!");
 }
 
+// Copies an array of byte values into buf (which holds len bytes), reading
+// each element once. Fails on anything but a number from 0 to 255.
+static bool _unpackBytes(const Value& list, unsigned char* buf, size_t len) {
+	for (size_t i=0 ; i < len ; i++) {
+		Value  item = list[i];
+		double val  = item.to<double>();
+		if (!item.isNumber() || !(val >= 0 && val < 256))
+			return false;
+		buf[i] = (unsigned char) val;
+	}
+	return true;
+}
+
 static Value binary_genericConstructor(Value& obj, Value& arg, bool supplen) {
 	if (supplen)
 		NATUS_CHECK_ARGUMENTS(arg, "|(oasn)s")
@@ -159,202 +395,1684 @@ static Value binary_genericConstructor(Value& obj, Value& arg, bool supplen) {
 	// Handles: Byte*(length)
 	if (supplen && arg[0].isNumber()) {
 		len = arg[0].to<size_t>();
-		buf = new unsigned char[len];
+		buf = alloc_buffer(len);
+		memset(buf, 0, len);
 	}
 
-	// Handles: Byte*(byteString) and Byte*(byteArray)
-	else if (arg[0].isObject()) {
-		const unsigned char* tmp = arg[0].getPrivate<const unsigned char*>(PRIV_BINARY_BUFFER);
-		if (tmp) {
-			len = arg[0].get("length").to<size_t>();
-			buf = new unsigned char[len];
-			memcpy(buf, tmp, len);
-		}
+	// Handles: Byte*(byteString) and Byte*(byteArray), sharing the memory
+	else if (binary_type(arg[0]) != BINARY_NONE) {
+		binary_buffer(arg[0], &len);
+		binary_share(obj, arg[0], 0, len);
+		return obj;
 	}
 
 	// Handles: Byte*(arrayOfNumbers)
 	else if (arg[0].isArray()) {
-		len = arg[0].get("length").to<size_t>();
-		buf = new unsigned char[len];
-		for (size_t i=0 ; i < len ; i++) {
-			ssize_t d = arg[0][i].to<ssize_t>();
-			if (d < 0 || d > 255) {
-				delete[] buf;
-				delete buf;
-				return throwException(arg, "RangeError", "Byte values must be between 0 and 255 inclusive!");
-			}
-			buf[i] = d;
+		Value list = arg[0];
+		len = list.get("length").to<size_t>();
+		buf = alloc_buffer(len);
+		if (!_unpackBytes(list, buf, len)) {
+			free_buffer(buf);
+			return throwException(arg, "RangeError", "Byte values must be between 0 and 255 inclusive!");
 		}
 	}
 
 	// Handles: Byte*(string, charset)
 	else if (arg.get("length").to<size_t>() > 1 && arg[0].isString() && arg[1].isString()) {
 		UTF16 data = arg[0].to<UTF16>();
-		Value rslt = convert(arg, "UCS-2-INTERNAL", arg[1].to<UTF8>().c_str(), data.length(), (unsigned char*) data.c_str(), &len, &buf);
+		Value rslt = convert(arg, "UCS-2-INTERNAL", arg[1].to<UTF8>().c_str(), data.length() * sizeof(UTF16::value_type), (unsigned char*) data.c_str(), &len, &buf);
 		if (rslt.isException()) return rslt;
 	}
 
-	obj.setPrivate(PRIV_BINARY_BUFFER, buf, (FreeFunction) free_buffer);
-	obj.set("length", (double) len, Value::PropAttrProtected);
+	binary_assign(obj, buf, len);
 	return obj;
 }
 
 static Value binary_ByteString(Value& fnc, Value& ths, Value& arg) {
-	Value obj = fnc.newObject(new BinaryStringClass);
+	Value obj = binary_new(fnc, BINARY_STRING, NULL, 0);
+	if (obj.isException()) return obj;
 	return binary_genericConstructor(obj, arg, false);
 }
 
-static Value _join(Value& arg) {
-	NATUS_CHECK_ARGUMENTS(arg, "an");
-
-	size_t len = arg[0].get("length").to<size_t>();
-
-	Value array = arg.newArray();
-	for (size_t i=0 ; i < len ; i++) {
-		arrayBuilder(array, arg[0][i]);
-		if (i+1 < len) arrayBuilder(array, arg[1]);
-	}
-
-	Value *data[2] = { &array, NULL };
-	return arg.newArray(data);
-}
-
 static Value binary_ByteArray(Value& fnc, Value& ths, Value& arg) {
-	Value obj = fnc.newObject(new BinaryArrayClass);
+	Value obj = binary_new(fnc, BINARY_ARRAY, NULL, 0);
+	if (obj.isException()) return obj;
 	return binary_genericConstructor(obj, arg, true);
 }
 
-static Value binary_ByteString__join(Value& fnc, Value& ths, Value& arg) {
-	Value args = _join(arg);
-	if (args.isException()) return args;
-	return binary_ByteString(fnc, ths, args);
-}
-
-static Value binary_ByteArray__join(Value& fnc, Value& ths, Value& arg) {
-	Value args = _join(arg);
-	if (args.isException()) return args;
-	return binary_ByteArray(fnc, ths, args);
-}
-
 static Value binary_ByteString_toByteArray(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|ss");
-	size_t         arglen = arg.get("length").to<size_t>();
-
-	size_t         srclen = ths.get("length").to<size_t>();
-	unsigned char* srcbuf = ths.getPrivate<unsigned char*>(PRIV_BINARY_BUFFER);
+	size_t arglen = arg.get("length").to<size_t>();
 
-	Value tmp = fnc.newArray();
-	Value obj = binary_ByteArray(fnc, ths, tmp);
-	if (obj.isException() || !srcbuf || srclen == 0) return obj;
+	size_t               srclen;
+	const unsigned char* srcbuf = binary_buffer(ths, &srclen);
 
-	if (arglen == 0) {
-		unsigned char* tmp = new unsigned char[srclen];
-		memcpy(tmp, srcbuf, srclen);
-		obj.setPrivate(PRIV_BINARY_BUFFER, tmp, (FreeFunction) free_buffer);
-		obj.set("length", (double) srclen, Value::PropAttrProtected);
-		return ths;
-	}
+	// Without conversion the new ByteArray shares our memory until it is written to
+	if (arglen == 0)
+		return binary_slice(ths, 0, srclen, BINARY_ARRAY);
 
 	if (arglen == 1)
-		return throwException(fnc, "ValueError", "ByteString.toByteString(src_encoding, dst_encoding) requires two arguments!");
+		return throwException(fnc, "ValueError", "ByteString.toByteArray(src_encoding, dst_encoding) requires two arguments!");
 
 	size_t len;
 	unsigned char* buf;
 	Value rslt = convert(ths, arg[0].to<UTF8>().c_str(), arg[1].to<UTF8>().c_str(), srclen, srcbuf, &len, &buf);
 	if (rslt.isException()) return rslt;
 
-	obj.setPrivate(PRIV_BINARY_BUFFER, buf, (FreeFunction) free_buffer);
-	obj.set("length", (double) len);
-	return obj;
+	return binary_new(ths, BINARY_ARRAY, buf, len);
 }
 
 static Value binary_ByteString_toByteString(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|ss");
 	size_t arglen = arg.get("length").to<size_t>();
-	const unsigned char* srcbuf = ths.getPrivate<const unsigned char*>(PRIV_BINARY_BUFFER);
 
+	size_t               srclen;
+	const unsigned char* srcbuf = binary_buffer(ths, &srclen);
+
+	// Without conversion a ByteString is returned as is, a ByteArray is shared
 	if (arglen == 0)
-		return ths;
+		return binary_type(ths) == BINARY_STRING ? ths : binary_slice(ths, 0, srclen, BINARY_STRING);
 
 	if (arglen == 1)
 		return throwException(fnc, "ValueError", "ByteString.toByteString(src_encoding, dst_encoding) requires two arguments!");
 
-	Value tmp = fnc.newArray();
-	Value obj = binary_ByteString(fnc, ths, tmp);
-	if (obj.isException() || !srcbuf) return obj;
-
 	size_t len;
 	unsigned char* buf;
-	Value rslt = convert(ths, arg[0].to<UTF8>().c_str(), arg[1].to<UTF8>().c_str(), ths.get("length").to<size_t>(), srcbuf, &len, &buf);
+	Value rslt = convert(ths, arg[0].to<UTF8>().c_str(), arg[1].to<UTF8>().c_str(), srclen, srcbuf, &len, &buf);
 	if (rslt.isException()) return rslt;
 
-	obj.setPrivate(PRIV_BINARY_BUFFER, buf, (FreeFunction) free_buffer);
-	obj.set("length", (double) len);
-	return obj;
+	return binary_new(ths, BINARY_STRING, buf, len);
 }
 
-extern "C" bool NATUS_MODULE_INIT(ntValue* base) {
-	Value module(base, false);
-	Value exports = module.get("exports");
+static const unsigned char* _find(const unsigned char* hay, size_t haylen, const unsigned char* ndl, size_t ndllen) {
+	if (ndllen == 1) return (const unsigned char*) memchr(hay, ndl[0], haylen);
+	return (const unsigned char*) memmem(hay, haylen, ndl, ndllen);
+}
 
-	exports.set("Binary", binary_Binary);
-	exports.setRecursive("ByteString",                          binary_ByteString);
-	exports.setRecursive("ByteString.join",                     binary_ByteString__join);
-	exports.setRecursive("ByteString.prototype.toByteArray",    binary_ByteString_toByteArray);
-	exports.setRecursive("ByteString.prototype.toByteString",   binary_ByteString_toByteString);
-	exports.setRecursive("ByteString.prototype.toArray",        binary_ByteString_toArray);
-	exports.setRecursive("ByteString.prototype.toString",       binary_ByteString_toString);
-	exports.setRecursive("ByteString.prototype.toSource",       binary_ByteString_toSource);
-	exports.setRecursive("ByteString.prototype.decodeToString", binary_ByteString_decodeToString);
-	exports.setRecursive("ByteString.prototype.indexOf",        binary_ByteString_indexOf);
-	exports.setRecursive("ByteString.prototype.lastIndexOf",    binary_ByteString_lastIndexOf);
-	exports.setRecursive("ByteString.prototype.codeAt",         binary_ByteString_codeAt);
-	exports.setRecursive("ByteString.prototype.byteAt",         binary_ByteString_byteAt);
-	exports.setRecursive("ByteString.prototype.valueAt",        binary_ByteString_valueAt);
-	exports.setRecursive("ByteString.prototype.get",            binary_ByteString_get);
-	exports.setRecursive("ByteString.prototype.copy",           binary_ByteString_copy);
-	exports.setRecursive("ByteString.prototype.split",          binary_ByteString_split);
-	exports.setRecursive("ByteString.prototype.slice",          binary_ByteString_slice);
-	exports.setRecursive("ByteString.prototype.concat",         binary_ByteString_concat);
-	exports.setRecursive("ByteString.prototype.substr",         binary_ByteString_substr);
-	exports.setRecursive("ByteString.prototype.substring",      binary_ByteString_substring);
+static const unsigned char* _rfind(const unsigned char* hay, size_t haylen, const unsigned char* ndl, size_t ndllen) {
+	if (ndllen > haylen) return NULL;
+	if (ndllen == 1) return (const unsigned char*) memrchr(hay, ndl[0], haylen);
 
-	exports.setRecursive("ByteArray",                           binary_ByteArray);
-	exports.setRecursive("ByteArray.join",                      binary_ByteArray__join);
-	exports.setRecursive("ByteString.prototype.toByteArray",    binary_ByteArray_toByteArray);
-	exports.setRecursive("ByteString.prototype.toByteString",   binary_ByteArray_toByteString);
-	exports.setRecursive("ByteString.prototype.toArray",        binary_ByteArray_toArray);
-	exports.setRecursive("ByteString.prototype.toString",       binary_ByteArray_toString);
-	exports.setRecursive("ByteString.prototype.toSource",       binary_ByteArray_toSource);
-	exports.setRecursive("ByteString.prototype.decodeToString", binary_ByteArray_decodeToString);
-	exports.setRecursive("ByteString.prototype.codeAt",         binary_ByteArray_codeAt);
-	exports.setRecursive("ByteString.prototype.byteAt",         binary_ByteArray_byteAt);
-	exports.setRecursive("ByteString.prototype.valueAt",        binary_ByteArray_valueAt);
-	exports.setRecursive("ByteString.prototype.get",            binary_ByteArray_get);
-	exports.setRecursive("ByteString.prototype.copy",           binary_ByteArray_copy);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_fill);
-	exports.setRecursive("ByteString.prototype.concat",         binary_ByteArray_concat);
-	exports.setRecursive("ByteString.prototype.pop",            binary_ByteArray_pop);
-	exports.setRecursive("ByteString.prototype.push",           binary_ByteArray_push);
-	exports.setRecursive("ByteString.prototype.extendRight",    binary_ByteArray_extendRight);
-	exports.setRecursive("ByteString.prototype.shift",          binary_ByteArray_shift);
-	exports.setRecursive("ByteString.prototype.unshift",        binary_ByteArray_unshift);
-	exports.setRecursive("ByteString.prototype.extendLeft",     binary_ByteArray_extendLeft);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_reverse);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_slice);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_sort);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_splice);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_indexOf);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_lastIndexOf);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_split);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_filter);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_forEach);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_every);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_some);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_map);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_reduce);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_reduceRight);
-	exports.setRecursive("ByteString.prototype.fill",           binary_ByteArray_displace);
+	// Walk the candidate first bytes backwards, confirming each with memcmp
+	for (size_t end=haylen - ndllen + 1 ; end > 0 ; ) {
+		const unsigned char* tmp = (const unsigned char*) memrchr(hay, ndl[0], end);
+		if (!tmp) break;
+		if (!memcmp(tmp + 1, ndl + 1, ndllen - 1)) return tmp;
+		end = tmp - hay;
+	}
+	return NULL;
+}
+
+// Resolves a needle (a byte or a ByteString/ByteArray) to a buffer
+static Value _needle(const Value& ndl, unsigned char* byte, const unsigned char** buf, size_t* len) {
+	if (ndl.isNumber()) {
+		long val = ndl.to<long>();
+		if (val < 0 || val > 255)
+			return throwException(ndl, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+		*byte = val;
+		*buf  = byte;
+		*len  = 1;
+		return ndl.newUndefined();
+	}
+
+	if (binary_type(ndl) == BINARY_NONE)
+		return throwException(ndl, "TypeError", "Argument must be a byte, ByteString or ByteArray!");
+	*buf = binary_buffer(ndl, len);
+	return ndl.newUndefined();
+}
+
+// Parses optional (start, stop) arguments, counting negative values from the end
+static void _bounds(Value& arg, long first, size_t len, size_t* start, size_t* stop) {
+	ssize_t argc = arg.get("length").to<ssize_t>();
+	ssize_t beg  = argc > first     ? arg[first].to<ssize_t>()     : 0;
+	ssize_t end  = argc > first + 1 ? arg[first + 1].to<ssize_t>() : (ssize_t) len;
+	if (beg < 0) beg += len;
+	if (end < 0) end += len;
+
+	*start = beg < 0 ? 0 : (size_t) beg > len ? len : beg;
+	*stop  = end < 0 ? 0 : (size_t) end > len ? len : end;
+	if (*stop < *start) *stop = *start;
+}
+
+static Value _indexOf(Value& ths, Value& arg, bool last) {
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+	if (arg.get("length").to<long>() < 1)
+		return throwException(ths, "TypeError", "Missing search argument!");
+
+	unsigned char        byte;
+	const unsigned char* ndl;
+	size_t               ndllen;
+	Value rslt = _needle(arg[0], &byte, &ndl, &ndllen);
+	if (rslt.isException()) return rslt;
+
+	size_t len, start, stop;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	_bounds(arg, 1, len, &start, &stop);
+	if (ndllen == 0)
+		return ths.newNumber(last ? stop : start);
+	if (!buf)
+		return ths.newNumber(-1);
+
+	const unsigned char* tmp = last
+			? _rfind(buf + start, stop - start, ndl, ndllen)
+			: _find(buf + start, stop - start, ndl, ndllen);
+	return ths.newNumber(tmp ? (double) (tmp - buf) : -1);
+}
+
+struct Delimiter {
+	const unsigned char* buf;
+	size_t               len;
+	const unsigned char* next; // Next match, or NULL once exhausted
+};
+
+// Splits on any of the delimiters into slices of ths
+static Value _split(Value& ths, Value& arg) {
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+	if (arg.get("length").to<long>() < 1)
+		return throwException(ths, "TypeError", "Missing delimiter argument!");
+
+	size_t len;
+	const unsigned char* buf = binary_buffer(ths, &len);
+
+	// Resolve the delimiters
+	Value  list = arg[0];
+	size_t cnt  = list.isArray() ? list.get("length").to<size_t>() : 1;
+	vector<unsigned char> bytes(cnt);
+	vector<Delimiter>     delims(cnt);
+	for (size_t i=0 ; i < cnt ; i++) {
+		Value item = list.isArray() ? list[i] : list;
+		Value rslt = _needle(item, &bytes[i], &delims[i].buf, &delims[i].len);
+		if (rslt.isException()) return rslt;
+		if (delims[i].len == 0)
+			return throwException(ths, "RangeError", "Delimiters must not be empty!");
+		delims[i].next = buf ? _find(buf, len, delims[i].buf, delims[i].len) : NULL;
+	}
+
+	// Parse the options
+	size_t max  = 0;
+	bool   incl = false;
+	if (arg.get("length").to<long>() > 1 && arg[1].isObject()) {
+		Value count = arg[1].get("count");
+		if (count.isNumber() && count.to<long>() > 0) max = count.to<size_t>();
+		incl = arg[1].get("includeDelimiter").to<bool>();
+	}
+
+	Value  parts = ths.newArray();
+	size_t pos   = 0;
+	for (size_t n=1 ; buf && (max == 0 || n < max) ; n++) {
+		// Find the earliest match, only rescanning delimiters we've passed
+		Delimiter* best = NULL;
+		for (size_t i=0 ; i < cnt ; i++) {
+			if (delims[i].next && delims[i].next < buf + pos)
+				delims[i].next = _find(buf + pos, len - pos, delims[i].buf, delims[i].len);
+			if (delims[i].next && (!best || delims[i].next < best->next))
+				best = &delims[i];
+		}
+		if (!best) break;
+
+		size_t at = best->next - buf;
+		Value part = binary_slice(ths, pos, at - pos);
+		if (part.isException()) return part;
+		arrayBuilder(parts, part);
+
+		if (incl) {
+			part = binary_slice(ths, at, best->len);
+			if (part.isException()) return part;
+			arrayBuilder(parts, part);
+		}
+		pos = at + best->len;
+	}
+
+	Value part = binary_slice(ths, pos, len - pos);
+	if (part.isException()) return part;
+	arrayBuilder(parts, part);
+	return parts;
+}
+
+// Handles slice(begin, [end]) for both types; the result shares our memory
+static Value _slice(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|nn");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t len, start, stop;
+	binary_buffer(ths, &len);
+	_bounds(arg, 0, len, &start, &stop);
+	return binary_slice(ths, start, stop - start);
+}
+
+// Handles copy(target, [start], [stop], [targetStart]) for both types
+static Value _copy(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|nnn");
+	if (binary_type(arg[0]) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Target must be a ByteArray!");
+
+	size_t len, start, stop;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	_bounds(arg, 1, len, &start, &stop);
+
+	size_t dstlen;
+	size_t dstoff = arg.get("length").to<long>() > 3 ? arg[3].to<size_t>() : 0;
+	unsigned char* dst = binary_mutable(arg[0], &dstlen);
+	if (dstoff > dstlen || stop - start > dstlen - dstoff)
+		return throwException(ths, "RangeError", "Copy extends past the end of the target!");
+
+	if (stop > start) memmove(dst + dstoff, buf + start, stop - start);
+	return ths.newUndefined();
+}
+
+// Measures one byte source (a byte, an array of bytes, a ByteString or a
+// ByteArray) and, once validated, copies it to dst (if set)
+static Value _gatherItem(Value& ctx, const Value& item, unsigned char* dst, size_t* len) {
+	if (binary_type(item) != BINARY_NONE) {
+		const unsigned char* buf = binary_buffer(item, len);
+		if (dst && *len) memmove(dst, buf, *len);
+	} else if (item.isNumber()) {
+		long val = item.to<long>();
+		if (val < 0 || val > 255)
+			return throwException(ctx, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+		if (dst) *dst = val;
+		*len = 1;
+	} else if (item.isArray()) {
+		*len = item.get("length").to<size_t>();
+		for (size_t j=0 ; j < *len ; j++) {
+			Value byte = item[j];
+			long  val  = byte.to<long>();
+			if (!dst && (!byte.isNumber() || val < 0 || val > 255))
+				return throwException(ctx, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+			if (dst) dst[j] = val;
+		}
+	} else
+		return throwException(ctx, "TypeError", "Arguments must be bytes, arrays of bytes, ByteStrings or ByteArrays!");
+
+	return ctx.newUndefined();
+}
+
+// Measures the bytes given as arguments and, once validated, copies them
+// to dst (if set)
+static Value _gather(Value& arg, unsigned char* dst, size_t* len) {
+	size_t argc = arg.get("length").to<size_t>();
+
+	*len = 0;
+	for (size_t i=0 ; i < argc ; i++) {
+		size_t cnt;
+		Value rslt = _gatherItem(arg, arg[i], dst ? dst + *len : NULL, &cnt);
+		if (rslt.isException()) return rslt;
+		*len += cnt;
+	}
+
+	return arg.newUndefined();
+}
+
+// Handles join(array, [delimiter]) for both types: measures the parts
+// (and the delimiter, which takes the same forms) so that the result is
+// built in a single allocation
+static Value _join(Value& fnc, Value& arg, BinaryType type) {
+	NATUS_CHECK_ARGUMENTS(arg, "a|(noa)");
+
+	size_t dlen = 0;
+	vector<unsigned char> delim;
+	if (arg.get("length").to<long>() > 1) {
+		Value rslt = _gatherItem(fnc, arg[1], NULL, &dlen);
+		if (rslt.isException()) return rslt;
+		delim.resize(dlen);
+		if (dlen) _gatherItem(fnc, arg[1], &delim[0], &dlen);
+	}
+
+	Value  list = arg[0];
+	size_t cnt  = list.get("length").to<size_t>();
+	size_t len  = cnt > 1 ? (cnt - 1) * dlen : 0;
+	vector<Value>  items(cnt);
+	vector<size_t> sizes(cnt);
+	for (size_t i=0 ; i < cnt ; i++) {
+		items[i] = list[i];
+		Value rslt = _gatherItem(fnc, items[i], NULL, &sizes[i]);
+		if (rslt.isException()) return rslt;
+		len += sizes[i];
+	}
+
+	unsigned char* buf = alloc_buffer(len);
+	unsigned char* pos = buf;
+	for (size_t i=0 ; i < cnt ; i++) {
+		if (i > 0 && dlen) {
+			memcpy(pos, &delim[0], dlen);
+			pos += dlen;
+		}
+		_gatherItem(fnc, items[i], pos, &sizes[i]);
+		pos += sizes[i];
+	}
+
+	return binary_new(fnc, type, buf, len);
+}
+
+// Handles concat(values...), returning a new binary of the same type
+static Value _concat(Value& ths, Value& arg) {
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t cnt;
+	Value rslt = _gather(arg, NULL, &cnt);
+	if (rslt.isException()) return rslt;
+
+	size_t len;
+	const unsigned char* src = binary_buffer(ths, &len);
+	unsigned char*       buf = alloc_buffer(len + cnt);
+	if (len) memcpy(buf, src, len);
+	_gather(arg, buf + len, &cnt);
+	return binary_new(ths, binary_type(ths), buf, len + cnt);
+}
+
+static Value binary_ByteString_concat(Value& fnc, Value& ths, Value& arg) {
+	return _concat(ths, arg);
+}
+
+static Value binary_ByteArray_concat(Value& fnc, Value& ths, Value& arg) {
+	return _concat(ths, arg);
+}
+
+static Value binary_ByteString__join(Value& fnc, Value& ths, Value& arg) {
+	return _join(fnc, arg, BINARY_STRING);
+}
+
+static Value binary_ByteArray__join(Value& fnc, Value& ths, Value& arg) {
+	return _join(fnc, arg, BINARY_ARRAY);
+}
+
+// Appends (or prepends) the arguments in amortized O(1) per byte
+static Value _extend(Value& ths, Value& arg, bool left) {
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	size_t cnt;
+	Value rslt = _gather(arg, NULL, &cnt);
+	if (rslt.isException()) return rslt;
+
+	size_t len;
+	binary_buffer(ths, &len);
+	if (cnt == 0) return ths.newNumber(len);
+
+	// Sources still see the old length, even when one of them is ths
+	unsigned char* buf = binary_reserve(ths, left ? cnt : 0, left ? 0 : cnt);
+	_gather(arg, left ? buf - cnt : buf + len, &cnt);
+	binary_resize(ths, left ? -(ssize_t) cnt : 0, len + cnt);
+	return ths.newNumber(len + cnt);
+}
+
+// Removes and returns the last (or first) byte without touching the memory
+static Value _remove(Value& ths, bool left) {
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	size_t len;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	if (len == 0) return ths.newUndefined();
+
+	unsigned char val = left ? buf[0] : buf[len - 1];
+	binary_resize(ths, left ? 1 : 0, len - 1);
+	return ths.newNumber(val);
+}
+
+// Converts cnt bytes from off into a JS array, built in a single call.
+// There are only 256 distinct elements, so each number is made once and
+// then shared, rather than costing an engine call per byte.
+static Value _toArray(Value& ths, size_t off, size_t cnt) {
+	const unsigned char* buf = binary_buffer(ths, NULL);
+
+	vector<Value>  nums(256);
+	vector<bool>   made(256, false);
+	vector<Value*> ptrs(cnt + 1, (Value*) NULL);
+	for (size_t i=0 ; i < cnt ; i++) {
+		unsigned char byte = buf[off + i];
+		if (!made[byte]) {
+			nums[byte] = ths.newNumber(byte);
+			made[byte] = true;
+		}
+		ptrs[i] = &nums[byte];
+	}
+	return ths.newArray(&ptrs[0]);
+}
+
+// Handles toArray([start], [stop]) for both types
+static Value _toArrayRange(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|nn");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t len, start, stop;
+	binary_buffer(ths, &len);
+	_bounds(arg, 0, len, &start, &stop);
+	return _toArray(ths, start, stop - start);
+}
+
+// Handles readUInt8Array(offset, [count]) for both types
+static Value _readUInt8Array(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n|n");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t  len;
+	binary_buffer(ths, &len);
+	ssize_t off = arg[0].to<ssize_t>();
+	if (off < 0 || (size_t) off > len)
+		return throwException(ths, "RangeError", "Offset is outside of the buffer!");
+
+	ssize_t cnt = arg.get("length").to<long>() > 1 ? arg[1].to<ssize_t>() : (ssize_t) (len - off);
+	if (cnt < 0 || (size_t) cnt > len - off)
+		return throwException(ths, "RangeError", "Length extends past the end of the buffer!");
+	return _toArray(ths, off, cnt);
+}
+
+static Value binary_ByteString_toArray(Value& fnc, Value& ths, Value& arg) {
+	return _toArrayRange(ths, arg);
+}
+
+static Value binary_ByteString_readUInt8Array(Value& fnc, Value& ths, Value& arg) {
+	return _readUInt8Array(ths, arg);
+}
+
+static Value binary_ByteString_indexOf(Value& fnc, Value& ths, Value& arg) {
+	return _indexOf(ths, arg, false);
+}
+
+static Value binary_ByteString_lastIndexOf(Value& fnc, Value& ths, Value& arg) {
+	return _indexOf(ths, arg, true);
+}
+
+static Value binary_ByteString_split(Value& fnc, Value& ths, Value& arg) {
+	return _split(ths, arg);
+}
+
+static Value binary_ByteString_slice(Value& fnc, Value& ths, Value& arg) {
+	return _slice(ths, arg);
+}
+
+static Value binary_ByteString_substr(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n|n");
+
+	size_t  len;
+	binary_buffer(ths, &len);
+	ssize_t start = arg[0].to<ssize_t>();
+	if (start < 0) start = (ssize_t) len + start < 0 ? 0 : len + start;
+	if ((size_t) start > len) start = len;
+
+	ssize_t cnt = arg.get("length").to<long>() > 1 ? arg[1].to<ssize_t>() : (ssize_t) (len - start);
+	if (cnt < 0) cnt = 0;
+	if ((size_t) cnt > len - start) cnt = len - start;
+	return binary_slice(ths, start, cnt);
+}
+
+static Value binary_ByteString_substring(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n|n");
+
+	size_t  len;
+	binary_buffer(ths, &len);
+	ssize_t first = arg[0].to<ssize_t>();
+	ssize_t last  = arg.get("length").to<long>() > 1 ? arg[1].to<ssize_t>() : (ssize_t) len;
+	first = first < 0 ? 0 : (size_t) first > len ? len : first;
+	last  = last  < 0 ? 0 : (size_t) last  > len ? len : last;
+	if (first > last) std::swap(first, last);
+	return binary_slice(ths, first, last - first);
+}
+
+static Value binary_ByteString_copy(Value& fnc, Value& ths, Value& arg) {
+	return _copy(ths, arg);
+}
+
+static Value binary_ByteArray_slice(Value& fnc, Value& ths, Value& arg) {
+	return _slice(ths, arg);
+}
+
+static Value binary_ByteArray_copy(Value& fnc, Value& ths, Value& arg) {
+	return _copy(ths, arg);
+}
+
+static Value binary_ByteArray_toArray(Value& fnc, Value& ths, Value& arg) {
+	return _toArrayRange(ths, arg);
+}
+
+static Value binary_ByteArray_readUInt8Array(Value& fnc, Value& ths, Value& arg) {
+	return _readUInt8Array(ths, arg);
+}
+
+static Value binary_ByteArray_push(Value& fnc, Value& ths, Value& arg) {
+	return _extend(ths, arg, false);
+}
+
+static Value binary_ByteArray_pop(Value& fnc, Value& ths, Value& arg) {
+	return _remove(ths, false);
+}
+
+static Value binary_ByteArray_extendRight(Value& fnc, Value& ths, Value& arg) {
+	return _extend(ths, arg, false);
+}
+
+static Value binary_ByteArray_unshift(Value& fnc, Value& ths, Value& arg) {
+	return _extend(ths, arg, true);
+}
+
+static Value binary_ByteArray_shift(Value& fnc, Value& ths, Value& arg) {
+	return _remove(ths, true);
+}
+
+static Value binary_ByteArray_extendLeft(Value& fnc, Value& ths, Value& arg) {
+	return _extend(ths, arg, true);
+}
+
+static Value binary_ByteArray_reserve(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n");
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	size_t len;
+	size_t cap = arg[0].to<size_t>();
+	binary_buffer(ths, &len);
+	binary_reserve(ths, 0, cap > len ? cap - len : 0);
+	return ths.newUndefined();
+}
+
+static Value binary_ByteArray_shrinkToFit(Value& fnc, Value& ths, Value& arg) {
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	binary_compact(ths);
+	return ths.newUndefined();
+}
+
+static Value binary_ByteArray_indexOf(Value& fnc, Value& ths, Value& arg) {
+	return _indexOf(ths, arg, false);
+}
+
+static Value binary_ByteArray_lastIndexOf(Value& fnc, Value& ths, Value& arg) {
+	return _indexOf(ths, arg, true);
+}
+
+static Value binary_ByteArray_split(Value& fnc, Value& ths, Value& arg) {
+	return _split(ths, arg);
+}
+
+#ifdef __SSE2__
+// Reverses the 16 bytes of v using only SSE2 shuffles
+static inline __m128i _reverse16(__m128i v) {
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+#endif
+
+// Reverses buf in place, swapping 16 byte blocks from both ends at a time
+static void _reverseBytes(unsigned char* buf, size_t len) {
+	size_t lo = 0, hi = len;
+#ifdef __SSE2__
+	for ( ; hi - lo >= 32 ; lo += 16, hi -= 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (buf + lo));
+		__m128i b = _mm_loadu_si128((const __m128i*) (buf + hi - 16));
+		_mm_storeu_si128((__m128i*) (buf + lo),      _reverse16(b));
+		_mm_storeu_si128((__m128i*) (buf + hi - 16), _reverse16(a));
+	}
+#endif
+	for ( ; lo + 1 < hi ; lo++, hi--)
+		std::swap(buf[lo], buf[hi - 1]);
+}
+
+// Counts the occurrences of each byte value. Alternating between four
+// tables keeps runs of equal bytes from serializing on one counter.
+static void _countBytes(const unsigned char* buf, size_t len, size_t counts[256]) {
+	size_t part[4][256];
+	memset(part, 0, sizeof(part));
+
+	size_t i = 0;
+	for ( ; i + 4 <= len ; i += 4) {
+		part[0][buf[i]]++;
+		part[1][buf[i + 1]]++;
+		part[2][buf[i + 2]]++;
+		part[3][buf[i + 3]]++;
+	}
+	for ( ; i < len ; i++)
+		part[0][buf[i]]++;
+
+	for (int j=0 ; j < 256 ; j++)
+		counts[j] = part[0][j] + part[1][j] + part[2][j] + part[3][j];
+}
+
+// Orders byte values with a JS compare function, remembering the first exception
+struct ByteCompare {
+	Value  fnc;
+	Value* exc;
+
+	bool operator()(unsigned char a, unsigned char b) {
+		if (!exc->isUndefined()) return false;
+
+		Value args = fnc.newArray();
+		arrayBuilder(args, (long) a);
+		arrayBuilder(args, (long) b);
+		Value rslt = fnc.call(fnc.newUndefined(), args);
+		if (rslt.isException()) {
+			*exc = rslt;
+			return false;
+		}
+		return rslt.to<double>() < 0;
+	}
+};
+
+// Handles sort([compare]) with a counting sort. A compare function only
+// orders the distinct byte values present, so it is called O(k log k)
+// times for k <= 256 values rather than once per comparison of elements.
+static Value _sort(Value& ths, Value& arg) {
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	Value cmp = arg.get("length").to<long>() > 0 ? arg[0] : ths.newUndefined();
+	if (!cmp.isUndefined() && !cmp.isFunction())
+		return throwException(ths, "TypeError", "Compare argument must be a function!");
+
+	size_t len;
+	binary_buffer(ths, &len);
+	if (len < 2) return ths;
+
+	size_t counts[256];
+	unsigned char* buf = binary_mutable(ths, &len);
+	_countBytes(buf, len, counts);
+
+	vector<unsigned char> order;
+	for (int i=0 ; i < 256 ; i++)
+		if (counts[i]) order.push_back(i);
+
+	if (!cmp.isUndefined()) {
+		Value       exc = ths.newUndefined();
+		ByteCompare compare = { cmp, &exc };
+		stable_sort(order.begin(), order.end(), compare);
+		if (!exc.isUndefined()) return exc;
+
+		// The callback may have resized or reallocated us
+		buf = binary_mutable(ths, &len);
+		size_t total = 0;
+		for (size_t i=0 ; i < order.size() ; i++)
+			total += counts[order[i]];
+		if (total != len)
+			return throwException(ths, "Error", "ByteArray was modified during sort!");
+	}
+
+	for (size_t i=0, pos=0 ; i < order.size() ; pos += counts[order[i]], i++)
+		memset(buf + pos, order[i], counts[order[i]]);
+	return ths;
+}
+
+static Value _reverse(Value& ths) {
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	size_t len;
+	binary_buffer(ths, &len);
+	if (len > 1) _reverseBytes(binary_mutable(ths, &len), len);
+	return ths;
+}
+
+// Handles fill(byte, [start], [stop])
+static Value _fill(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n|nn");
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	long val = arg[0].to<long>();
+	if (val < 0 || val > 255)
+		return throwException(ths, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+
+	size_t len, start, stop;
+	binary_buffer(ths, &len);
+	_bounds(arg, 1, len, &start, &stop);
+	if (stop > start) memset(binary_mutable(ths, &len) + start, val, stop - start);
+	return ths;
+}
+
+// Handles displace(start, stop, values...): replaces the range with the
+// values (as accepted by push()) and returns the new length
+static Value _displace(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nn");
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	// Collect the values first, since any of them may be ths
+	Value  rest = ths.newArray();
+	size_t argc = arg.get("length").to<size_t>();
+	for (size_t i=2 ; i < argc ; i++)
+		arrayBuilder(rest, arg[i]);
+
+	size_t cnt;
+	Value rslt = _gather(rest, NULL, &cnt);
+	if (rslt.isException()) return rslt;
+	vector<unsigned char> vals(cnt);
+	if (cnt) _gather(rest, &vals[0], &cnt);
+
+	size_t len, start, stop;
+	binary_buffer(ths, &len);
+	_bounds(arg, 0, len, &start, &stop);
+
+	size_t newlen = len - (stop - start) + cnt;
+	if (stop == start && cnt == 0) return ths.newNumber(len);
+
+	unsigned char* buf = newlen > len
+			? binary_reserve(ths, 0, newlen - len)
+			: binary_mutable(ths, &len);
+	if (stop < len && start + cnt != stop)
+		memmove(buf + start + cnt, buf + stop, len - stop);
+	if (cnt) memcpy(buf + start, &vals[0], cnt);
+	binary_resize(ths, 0, newlen);
+	return ths.newNumber(newlen);
+}
+
+// Gets the 256 entry lookup table given instead of a callback, if any
+static Value _table(Value& ths, const Value& val, const unsigned char** table) {
+	*table = NULL;
+	if (binary_type(val) == BINARY_NONE) {
+		if (val.isFunction()) return ths.newUndefined();
+		return throwException(ths, "TypeError", "Argument must be a function or a 256 byte lookup table!");
+	}
+
+	size_t len;
+	*table = binary_buffer(val, &len);
+	if (len != 256)
+		return throwException(ths, "RangeError", "Lookup tables must be exactly 256 bytes long!");
+	return ths.newUndefined();
+}
+
+// Calls fnc(byte, index, ths) for the byte at i
+static Value _visit(Value& fnc, Value& ths, const unsigned char* buf, size_t i) {
+	Value args = ths.newArray();
+	arrayBuilder(args, (long) buf[i]);
+	arrayBuilder(args, (long) i);
+	arrayBuilder(args, ths);
+	return fnc.call(ths.newUndefined(), args);
+}
+
+// Handles map(callback|table), returning a new binary of the same type
+static Value _map(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	const unsigned char* table;
+	Value rslt = _table(ths, arg[0], &table);
+	if (rslt.isException()) return rslt;
+
+	size_t len;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	unsigned char*       out = alloc_buffer(len);
+	if (table) {
+		for (size_t i=0 ; i < len ; i++)
+			out[i] = table[buf[i]];
+		return binary_new(ths, binary_type(ths), out, len);
+	}
+
+	// The callback may change us, so also stop at our current end
+	Value  fnc = arg[0];
+	size_t i, cur;
+	for (i=0 ; i < len && (buf = binary_buffer(ths, &cur)) && i < cur ; i++) {
+		rslt = _visit(fnc, ths, buf, i);
+		if (rslt.isException()) {
+			free_buffer(out);
+			return rslt;
+		}
+		long val = rslt.to<long>();
+		if (!rslt.isNumber() || val < 0 || val > 255) {
+			free_buffer(out);
+			return throwException(ths, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+		}
+		out[i] = val;
+	}
+	return binary_new(ths, binary_type(ths), out, i);
+}
+
+// Handles filter(callback|table), keeping the bytes for which the callback
+// returns true or the table entry is non-zero
+static Value _filter(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	const unsigned char* table;
+	Value rslt = _table(ths, arg[0], &table);
+	if (rslt.isException()) return rslt;
+
+	size_t len, cnt = 0;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	unsigned char*       out = alloc_buffer(len);
+	if (table) {
+		// Always store, but only advance past the bytes we keep
+		for (size_t i=0 ; i < len ; i++) {
+			out[cnt] = buf[i];
+			cnt += table[buf[i]] != 0;
+		}
+		return binary_new(ths, binary_type(ths), out, cnt);
+	}
+
+	Value  fnc = arg[0];
+	size_t cur;
+	for (size_t i=0 ; i < len && (buf = binary_buffer(ths, &cur)) && i < cur ; i++) {
+		unsigned char byte = buf[i];
+		rslt = _visit(fnc, ths, buf, i);
+		if (rslt.isException()) {
+			free_buffer(out);
+			return rslt;
+		}
+		if (rslt.to<bool>()) out[cnt++] = byte;
+	}
+	return binary_new(ths, binary_type(ths), out, cnt);
+}
+
+static Value binary_ByteArray_sort(Value& fnc, Value& ths, Value& arg) {
+	return _sort(ths, arg);
+}
+
+static Value binary_ByteArray_reverse(Value& fnc, Value& ths, Value& arg) {
+	return _reverse(ths);
+}
+
+static Value binary_ByteArray_fill(Value& fnc, Value& ths, Value& arg) {
+	return _fill(ths, arg);
+}
+
+static Value binary_ByteArray_displace(Value& fnc, Value& ths, Value& arg) {
+	return _displace(ths, arg);
+}
+
+static Value binary_ByteArray_map(Value& fnc, Value& ths, Value& arg) {
+	return _map(ths, arg);
+}
+
+static Value binary_ByteArray_filter(Value& fnc, Value& ths, Value& arg) {
+	return _filter(ths, arg);
+}
+
+// Numeric types for the typed read*()/write*() accessors
+enum NumType {
+	NUM_INT8,
+	NUM_UINT8,
+	NUM_INT16,
+	NUM_UINT16,
+	NUM_INT32,
+	NUM_UINT32,
+	NUM_INT64,
+	NUM_UINT64,
+	NUM_FLOAT32,
+	NUM_FLOAT64,
+	NUM_NONE
+};
+
+static const struct {
+	const char* name;  // As given to readArray()/writeArray()
+	size_t      size;
+	double      min;   // Integer range is [min, limit)
+	double      limit;
+} numtypes[] = {
+	{ "int8",    1, -128.0,                 128.0 },
+	{ "uint8",   1, 0,                      256.0 },
+	{ "int16",   2, -32768.0,               32768.0 },
+	{ "uint16",  2, 0,                      65536.0 },
+	{ "int32",   4, -2147483648.0,          2147483648.0 },
+	{ "uint32",  4, 0,                      4294967296.0 },
+	{ "int64",   8, -9223372036854775808.0, 9223372036854775808.0 },
+	{ "uint64",  8, 0,                      18446744073709551616.0 },
+	{ "float32", 4, 0,                      0 },
+	{ "float64", 8, 0,                      0 },
+};
+
+#define NUM_IS_FLOAT(type) ((type) == NUM_FLOAT32 || (type) == NUM_FLOAT64)
+#define NUM_IS_WIDE(type)  ((type) == NUM_INT64   || (type) == NUM_UINT64)
+
+static uint64_t _load(const unsigned char* buf, size_t size, bool be) {
+	bool swap = be != HOST_BIG_ENDIAN;
+	switch (size) {
+		case 1:
+			return buf[0];
+		case 2: {
+			uint16_t val;
+			memcpy(&val, buf, sizeof(val));
+			return swap ? __builtin_bswap16(val) : val;
+		}
+		case 4: {
+			uint32_t val;
+			memcpy(&val, buf, sizeof(val));
+			return swap ? __builtin_bswap32(val) : val;
+		}
+		default: {
+			uint64_t val;
+			memcpy(&val, buf, sizeof(val));
+			return swap ? __builtin_bswap64(val) : val;
+		}
+	}
+}
+
+static void _store(unsigned char* buf, size_t size, bool be, uint64_t raw) {
+	bool swap = be != HOST_BIG_ENDIAN;
+	switch (size) {
+		case 1:
+			buf[0] = raw;
+			break;
+		case 2: {
+			uint16_t val = swap ? __builtin_bswap16(raw) : raw;
+			memcpy(buf, &val, sizeof(val));
+			break;
+		}
+		case 4: {
+			uint32_t val = swap ? __builtin_bswap32(raw) : raw;
+			memcpy(buf, &val, sizeof(val));
+			break;
+		}
+		default: {
+			uint64_t val = swap ? __builtin_bswap64(raw) : raw;
+			memcpy(buf, &val, sizeof(val));
+			break;
+		}
+	}
+}
+
+static double _todouble(NumType type, uint64_t raw) {
+	switch (type) {
+		case NUM_INT8:  return (int8_t)  raw;
+		case NUM_INT16: return (int16_t) raw;
+		case NUM_INT32: return (int32_t) raw;
+		case NUM_INT64: return (double) (int64_t) raw;
+		case NUM_FLOAT32: {
+			uint32_t bits = raw;
+			float    val;
+			memcpy(&val, &bits, sizeof(val));
+			return val;
+		}
+		case NUM_FLOAT64: {
+			double val;
+			memcpy(&val, &raw, sizeof(val));
+			return val;
+		}
+		default:
+			return (double) raw;
+	}
+}
+
+// Converts a number (or, for 64-bit integers, a [high, low] pair) to raw bits
+static Value _encode(const Value& val, NumType type, uint64_t* raw) {
+	if (NUM_IS_WIDE(type) && val.isArray()) {
+		double hi = val[0].to<double>();
+		double lo = val[1].to<double>();
+		double himin = type == NUM_INT64 ? numtypes[NUM_INT32].min   : 0;
+		double hilim = type == NUM_INT64 ? numtypes[NUM_INT32].limit : numtypes[NUM_UINT32].limit;
+		if (!(hi >= himin && hi < hilim) || !(lo >= 0 && lo < numtypes[NUM_UINT32].limit))
+			return throwException(val, "RangeError", "Value is out of range for the type!");
+		*raw = (uint64_t) (uint32_t) (int64_t) hi << 32 | (uint32_t) lo;
+		return val.newUndefined();
+	}
+
+	if (!val.isNumber())
+		return throwException(val, "TypeError", "Value must be a number!");
+
+	double num = val.to<double>();
+	if (type == NUM_FLOAT32) {
+		float    tmp  = num;
+		uint32_t bits;
+		memcpy(&bits, &tmp, sizeof(bits));
+		*raw = bits;
+	} else if (type == NUM_FLOAT64) {
+		memcpy(raw, &num, sizeof(*raw));
+	} else if (!(num >= numtypes[type].min && num < numtypes[type].limit)) {
+		return throwException(val, "RangeError", "Value is out of range for the type!");
+	} else
+		*raw = numtypes[type].min < 0 ? (uint64_t) (int64_t) num : (uint64_t) num;
+	return val.newUndefined();
+}
+
+// Parses a format such as "uint16le" or "float64be"
+static NumType _numtype(const Value& fmt, bool* be) {
+	UTF8 name = fmt.to<UTF8>();
+	for (int i=0 ; i < NUM_NONE ; i++) {
+		size_t len = strlen(numtypes[i].name);
+		if (name.compare(0, len, numtypes[i].name)) continue;
+
+		UTF8 order = name.substr(len);
+		if (order == "le" || order == "be" || (order == "" && numtypes[i].size == 1)) {
+			*be = order == "be";
+			return (NumType) i;
+		}
+	}
+	return NUM_NONE;
+}
+
+// Checks that cnt items of size bytes, stride bytes apart, fit from off on
+static bool _fits(size_t len, ssize_t off, size_t cnt, size_t size, size_t stride) {
+	if (off < 0 || (size_t) off > len) return false;
+	if (cnt == 0) return true;
+	if (len - off < size) return false;
+	return stride == 0 || (cnt - 1) <= (len - off - size) / stride;
+}
+
+static Value _readNumber(Value& ths, Value& arg, NumType type, bool be) {
+	NATUS_CHECK_ARGUMENTS(arg, "n|b");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t  len;
+	size_t  size = numtypes[type].size;
+	ssize_t off  = arg[0].to<ssize_t>();
+	const unsigned char* buf = binary_buffer(ths, &len);
+	if (!_fits(len, off, 1, size, size))
+		return throwException(ths, "RangeError", "Read extends past the end of the buffer!");
+
+	uint64_t raw = _load(buf + off, size, be);
+
+	// Numbers can't hold every 64-bit integer, so these can be read as [high, low]
+	if (NUM_IS_WIDE(type) && arg.get("length").to<long>() > 1 && arg[1].to<bool>()) {
+		Value hi = ths.newNumber(type == NUM_INT64 ? (double) (int32_t) (raw >> 32) : (double) (uint32_t) (raw >> 32));
+		Value lo = ths.newNumber((uint32_t) raw);
+		const Value* items[] = { &hi, &lo, NULL };
+		return ths.newArray(items);
+	}
+
+	return ths.newNumber(_todouble(type, raw));
+}
+
+static Value _writeNumber(Value& ths, Value& arg, NumType type, bool be) {
+	NATUS_CHECK_ARGUMENTS(arg, "n(na)");
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	size_t  len;
+	size_t  size = numtypes[type].size;
+	ssize_t off  = arg[0].to<ssize_t>();
+	binary_buffer(ths, &len);
+	if (!_fits(len, off, 1, size, size))
+		return throwException(ths, "RangeError", "Write extends past the end of the buffer!");
+
+	uint64_t raw;
+	Value rslt = _encode(arg[1], type, &raw);
+	if (rslt.isException()) return rslt;
+
+	_store(binary_mutable(ths, NULL) + off, size, be, raw);
+	return ths.newNumber(off + size);
+}
+
+// Handles readArray(format, offset, count, [stride]) for both types
+static Value _readArray(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "snn|n");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	bool    be;
+	NumType type = _numtype(arg[0], &be);
+	if (type == NUM_NONE)
+		return throwException(ths, "TypeError", "Unknown numeric format!");
+
+	size_t  len;
+	size_t  size   = numtypes[type].size;
+	ssize_t off    = arg[1].to<ssize_t>();
+	ssize_t cnt    = arg[2].to<ssize_t>();
+	size_t  stride = arg.get("length").to<long>() > 3 ? arg[3].to<size_t>() : size;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	if (stride == 0)
+		return throwException(ths, "RangeError", "Stride must be greater than zero!");
+	if (cnt < 0 || !_fits(len, off, cnt, size, stride))
+		return throwException(ths, "RangeError", "Read extends past the end of the buffer!");
+
+	vector<Value>  items;
+	vector<Value*> ptrs(cnt + 1, (Value*) NULL);
+	items.reserve(cnt);
+	for (ssize_t i=0 ; i < cnt ; i++) {
+		items.push_back(ths.newNumber(_todouble(type, _load(buf + off + i * stride, size, be))));
+		ptrs[i] = &items[i];
+	}
+	return ths.newArray(&ptrs[0]);
+}
+
+// Handles writeArray(format, offset, values, [stride])
+static Value _writeArray(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "sna|n");
+	if (binary_type(ths) != BINARY_ARRAY)
+		return throwException(ths, "TypeError", "Not a ByteArray!");
+
+	bool    be;
+	NumType type = _numtype(arg[0], &be);
+	if (type == NUM_NONE)
+		return throwException(ths, "TypeError", "Unknown numeric format!");
+
+	size_t  len;
+	size_t  size   = numtypes[type].size;
+	ssize_t off    = arg[1].to<ssize_t>();
+	size_t  cnt    = arg[2].get("length").to<size_t>();
+	size_t  stride = arg.get("length").to<long>() > 3 ? arg[3].to<size_t>() : size;
+	binary_buffer(ths, &len);
+	if (stride == 0)
+		return throwException(ths, "RangeError", "Stride must be greater than zero!");
+	if (!_fits(len, off, cnt, size, stride))
+		return throwException(ths, "RangeError", "Write extends past the end of the buffer!");
+
+	// Validate everything before touching the buffer
+	vector<uint64_t> raw(cnt);
+	for (size_t i=0 ; i < cnt ; i++) {
+		Value rslt = _encode(arg[2][i], type, &raw[i]);
+		if (rslt.isException()) return rslt;
+	}
+
+	unsigned char* buf = binary_mutable(ths, NULL);
+	for (size_t i=0 ; i < cnt ; i++)
+		_store(buf + off + i * stride, size, be, raw[i]);
+	return ths.newNumber(off + cnt * stride);
+}
+
+template <NumType T, bool BE>
+static Value binary_readNumber(Value& fnc, Value& ths, Value& arg) {
+	return _readNumber(ths, arg, T, BE);
+}
+
+template <NumType T, bool BE>
+static Value binary_writeNumber(Value& fnc, Value& ths, Value& arg) {
+	return _writeNumber(ths, arg, T, BE);
+}
+
+#define ACCESSOR(name, type, be) { name, binary_readNumber<type, be>, binary_writeNumber<type, be> }
+static const struct {
+	const char*    name;
+	NativeFunction read;
+	NativeFunction write;
+} accessors[] = {
+	ACCESSOR("Int8",      NUM_INT8,    false),
+	ACCESSOR("UInt8",     NUM_UINT8,   false),
+	ACCESSOR("Int16LE",   NUM_INT16,   false),
+	ACCESSOR("Int16BE",   NUM_INT16,   true),
+	ACCESSOR("UInt16LE",  NUM_UINT16,  false),
+	ACCESSOR("UInt16BE",  NUM_UINT16,  true),
+	ACCESSOR("Int32LE",   NUM_INT32,   false),
+	ACCESSOR("Int32BE",   NUM_INT32,   true),
+	ACCESSOR("UInt32LE",  NUM_UINT32,  false),
+	ACCESSOR("UInt32BE",  NUM_UINT32,  true),
+	ACCESSOR("Int64LE",   NUM_INT64,   false),
+	ACCESSOR("Int64BE",   NUM_INT64,   true),
+	ACCESSOR("UInt64LE",  NUM_UINT64,  false),
+	ACCESSOR("UInt64BE",  NUM_UINT64,  true),
+	ACCESSOR("Float32LE", NUM_FLOAT32, false),
+	ACCESSOR("Float32BE", NUM_FLOAT32, true),
+	ACCESSOR("Float64LE", NUM_FLOAT64, false),
+	ACCESSOR("Float64BE", NUM_FLOAT64, true),
+};
+
+static Value binary_ByteString_readArray(Value& fnc, Value& ths, Value& arg) {
+	return _readArray(ths, arg);
+}
+
+static Value binary_ByteArray_readArray(Value& fnc, Value& ths, Value& arg) {
+	return _readArray(ths, arg);
+}
+
+static Value binary_ByteArray_writeArray(Value& fnc, Value& ths, Value& arg) {
+	return _writeArray(ths, arg);
+}
+
+static Value _hash(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "s");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	HashAlgorithm algorithm = hash_lookup(arg[0].to<UTF8>().c_str());
+	if (algorithm == HASH_NONE)
+		return throwException(ths, "TypeError", "Unknown hash algorithm!");
+
+	size_t    len;
+	HashState state;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	hash_init(&state, algorithm);
+	hash_update(&state, buf, len);
+
+	unsigned char* digest = alloc_buffer(hash_size(algorithm));
+	hash_final(&state, digest);
+	return binary_new(ths, BINARY_STRING, digest, hash_size(algorithm));
+}
+
+// Handles crc32c([crc]); pass a previous result to continue it
+static Value _crc32c(Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t   len;
+	uint32_t crc = arg.get("length").to<long>() > 0 ? (uint32_t) arg[0].to<double>() : 0;
+	const unsigned char* buf = binary_buffer(ths, &len);
+	return ths.newNumber(crc32c(crc, buf, len));
+}
+
+static void hasher_free(HashState* state) {
+	delete state;
+}
+
+static HashState* _hasher(Value& ths) {
+	return ths.getPrivate<HashState*>(PRIV_BINARY_HASHER);
+}
+
+static Value binary_Hasher(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "s");
+
+	HashAlgorithm algorithm = hash_lookup(arg[0].to<UTF8>().c_str());
+	if (algorithm == HASH_NONE)
+		return throwException(fnc, "TypeError", "Unknown hash algorithm!");
+
+	Value obj = fnc.newObject();
+	if (obj.isException()) return obj;
+
+	HashState* state = new HashState;
+	hash_init(state, algorithm);
+	if (!obj.setPrivate(PRIV_BINARY_HASHER, state, (FreeFunction) hasher_free)) {
+		hasher_free(state);
+		return throwException(fnc, "Error", "Unable to create hasher!");
+	}
+
+	obj.set("__proto__", fnc.get("prototype"));
+	obj.set("algorithm", arg[0], Value::PropAttrConstant);
+	return obj;
+}
+
+// Handles update(data...) where data is a ByteString, ByteArray or string (as UTF-8)
+static Value binary_Hasher_update(Value& fnc, Value& ths, Value& arg) {
+	HashState* state = _hasher(ths);
+	if (!state) return throwException(ths, "TypeError", "Not a Hasher!");
+
+	long argc = arg.get("length").to<long>();
+	for (long i=0 ; i < argc ; i++) {
+		Value data = arg[i];
+		if (binary_type(data) != BINARY_NONE) {
+			size_t len;
+			const unsigned char* buf = binary_buffer(data, &len);
+			hash_update(state, buf, len);
+		} else if (data.isString()) {
+			UTF8 str = data.to<UTF8>();
+			hash_update(state, str.data(), str.length());
+		} else
+			return throwException(ths, "TypeError", "Data must be a ByteString, ByteArray or string!");
+	}
+
+	return ths;
+}
+
+// Handles updateFrom(stream, [max]): hashes what the stream has to offer
+// (until EOF, max bytes or, when non-blocking, no more data) without
+// creating a ByteString per chunk; returns the bytes hashed
+static Value binary_Hasher_updateFrom(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|n");
+	HashState* state = _hasher(ths);
+	if (!state) return throwException(ths, "TypeError", "Not a Hasher!");
+
+	Stream* stream = stream_get(arg[0]);
+	if (!stream) return throwException(ths, "TypeError", "Argument must be a stream!");
+
+	double max   = arg.get("length").to<long>() > 1 ? arg[1].to<double>() : -1;
+	double total = 0;
+	char   buf[STREAM_BUFFER_SIZE];
+	while (max < 0 || total < max) {
+		size_t  want = max < 0 || max - total > sizeof(buf) ? sizeof(buf) : (size_t) (max - total);
+		ssize_t rcvd = stream_read(stream, buf, want);
+		if (rcvd < 0) {
+			if (IO_WOULDBLOCK(errno)) break;
+			return throwException(ths, errno);
+		}
+		if (rcvd == 0) break;
+
+		hash_update(state, buf, rcvd);
+		total += rcvd;
+	}
+
+	return ths.newNumber(total);
+}
+
+// Returns the digest so far as a ByteString; the hasher can keep going
+static Value binary_Hasher_digest(Value& fnc, Value& ths, Value& arg) {
+	HashState* state = _hasher(ths);
+	if (!state) return throwException(ths, "TypeError", "Not a Hasher!");
+
+	HashState      copy   = *state;
+	unsigned char* digest = alloc_buffer(hash_size(copy.algorithm));
+	hash_final(&copy, digest);
+	return binary_new(ths, BINARY_STRING, digest, hash_size(copy.algorithm));
+}
+
+static Value binary_Hasher_reset(Value& fnc, Value& ths, Value& arg) {
+	HashState* state = _hasher(ths);
+	if (!state) return throwException(ths, "TypeError", "Not a Hasher!");
+
+	hash_init(state, state->algorithm);
+	return ths;
+}
+
+static Value binary_ByteString_hash(Value& fnc, Value& ths, Value& arg) {
+	return _hash(ths, arg);
+}
+
+static Value binary_ByteString_crc32c(Value& fnc, Value& ths, Value& arg) {
+	return _crc32c(ths, arg);
+}
+
+static Value binary_ByteArray_hash(Value& fnc, Value& ths, Value& arg) {
+	return _hash(ths, arg);
+}
+
+static Value binary_ByteArray_crc32c(Value& fnc, Value& ths, Value& arg) {
+	return _crc32c(ths, arg);
+}
+
+static const char base64_std[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64_url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const char hex_digits[] = "0123456789abcdef";
+
+// Length of the base64 encoding of len bytes, with or without padding
+static size_t base64_size(size_t len, bool pad) {
+	return pad ? (len + 2) / 3 * 4 : len / 3 * 4 + (len % 3 ? len % 3 + 1 : 0);
+}
+
+// Encodes len bytes into dst; URL-safe output is never padded
+static void base64_encode(const unsigned char* src, size_t len, char* dst, bool url) {
+	const char* abc = url ? base64_url : base64_std;
+
+	for ( ; len >= 3 ; len -= 3, src += 3, dst += 4) {
+		uint32_t val = src[0] << 16 | src[1] << 8 | src[2];
+		dst[0] = abc[val >> 18];
+		dst[1] = abc[(val >> 12) & 0x3F];
+		dst[2] = abc[(val >> 6) & 0x3F];
+		dst[3] = abc[val & 0x3F];
+	}
+
+	if (len > 0) {
+		uint32_t val = src[0] << 16 | (len > 1 ? src[1] << 8 : 0);
+		*dst++ = abc[val >> 18];
+		*dst++ = abc[(val >> 12) & 0x3F];
+		if (len > 1) *dst++ = abc[(val >> 6) & 0x3F];
+		if (!url) {
+			if (len < 2) *dst++ = '=';
+			*dst++ = '=';
+		}
+	}
+}
+
+// Decodes base64 (padding optional) into dst; returns false on invalid input
+static bool base64_decode(const unsigned char* src, size_t len, unsigned char* dst, size_t* dstlen, bool url) {
+	static int8_t table[2][256];
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct Init {
+		static void run() {
+			memset(table, -1, sizeof(table));
+			for (int i=0 ; i < 64 ; i++) {
+				table[0][(unsigned char) base64_std[i]] = i;
+				table[1][(unsigned char) base64_url[i]] = i;
+			}
+		}
+	};
+	pthread_once(&once, Init::run);
+	const int8_t* dec = table[url];
+
+	// Strip padding, which must complete the final quad
+	if (len % 4 == 0 && len > 0 && src[len - 1] == '=') len--;
+	if (len % 4 == 3 && src[len - 1] == '=') len--;
+	if (len % 4 == 1) return false;
+
+	unsigned char* out = dst;
+	for ( ; len >= 4 ; len -= 4, src += 4, out += 3) {
+		// Check for -1 before shifting; a negative value can't be shifted
+		int32_t a = dec[src[0]], b = dec[src[1]], c = dec[src[2]], d = dec[src[3]];
+		if ((a | b | c | d) < 0) return false;
+		int32_t val = a << 18 | b << 12 | c << 6 | d;
+		out[0] = val >> 16;
+		out[1] = val >> 8;
+		out[2] = val;
+	}
+
+	if (len > 0) {
+		int32_t a = dec[src[0]], b = dec[src[1]], c = len > 2 ? dec[src[2]] : 0;
+		if ((a | b | c) < 0) return false;
+		*out++ = (a << 2) | (b >> 4);
+		if (len > 2) *out++ = (b << 4) | (c >> 2);
+	}
+
+	*dstlen = out - dst;
+	return true;
+}
+
+// Writes two lowercase digits per byte into dst
+static void hex_encode(const unsigned char* src, size_t len, char* dst) {
+	size_t i = 0;
+#ifdef __SSE2__
+	// Split each byte into nibbles and map them to '0'-'9'/'a'-'f' in parallel
+	const __m128i mask  = _mm_set1_epi8(0x0F);
+	const __m128i nine  = _mm_set1_epi8(9);
+	const __m128i zero  = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+	for ( ; i + 16 <= len ; i += 16) {
+		__m128i v  = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+		_mm_storeu_si128((__m128i*) (dst + i * 2),      _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*) (dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+	for ( ; i < len ; i++) {
+		dst[i * 2]     = hex_digits[src[i] >> 4];
+		dst[i * 2 + 1] = hex_digits[src[i] & 0x0F];
+	}
+}
+
+static int hex_value(unsigned char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Accepts either case; returns false on odd length or invalid digits
+static bool hex_decode(const unsigned char* src, size_t len, unsigned char* dst) {
+	if (len % 2) return false;
+	for (size_t i=0 ; i < len / 2 ; i++) {
+		int hi = hex_value(src[i * 2]);
+		int lo = hex_value(src[i * 2 + 1]);
+		if ((hi | lo) < 0) return false;
+		dst[i] = hi << 4 | lo;
+	}
+	return true;
+}
+
+enum Encoding {
+	ENCODING_BASE64,
+	ENCODING_BASE64URL,
+	ENCODING_HEX
+};
+
+static Value _encodeString(Value& ths, Encoding enc) {
+	if (binary_type(ths) == BINARY_NONE)
+		return throwException(ths, "TypeError", "Not a ByteString or ByteArray!");
+
+	size_t len;
+	const unsigned char* buf = binary_buffer(ths, &len);
+
+	UTF8 out;
+	if (enc == ENCODING_HEX) {
+		out.resize(len * 2);
+		if (len) hex_encode(buf, len, &out[0]);
+	} else {
+		out.resize(base64_size(len, enc == ENCODING_BASE64));
+		if (len) base64_encode(buf, len, &out[0], enc == ENCODING_BASE64URL);
+	}
+	return ths.newString(out);
+}
+
+// Decodes a string (or a binary holding the text) into a new binary of type
+static Value _decodeString(Value& fnc, Value& arg, BinaryType type, Encoding enc) {
+	NATUS_CHECK_ARGUMENTS(arg, "(so)");
+
+	UTF8                 str;
+	const unsigned char* src;
+	size_t               len;
+	if (binary_type(arg[0]) != BINARY_NONE)
+		src = binary_buffer(arg[0], &len);
+	else if (arg[0].isString()) {
+		str = arg[0].to<UTF8>();
+		src = (const unsigned char*) str.data();
+		len = str.length();
+	} else
+		return throwException(fnc, "TypeError", "Argument must be a string, ByteString or ByteArray!");
+
+	size_t         size = enc == ENCODING_HEX ? len / 2 : len / 4 * 3 + 3;
+	unsigned char* buf  = alloc_buffer(size);
+	bool           ok   = enc == ENCODING_HEX
+			? hex_decode(src, len, buf)
+			: base64_decode(src, len, buf, &size, enc == ENCODING_BASE64URL);
+	if (!ok) {
+		free_buffer(buf);
+		return throwException(fnc, "ValueError", enc == ENCODING_HEX
+				? "Invalid hexadecimal data!"
+				: "Invalid base64 data!");
+	}
+
+	return binary_new(fnc, type, buf, size);
+}
+
+static Value binary_ByteString_toBase64(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_BASE64);
+}
+
+static Value binary_ByteString_toBase64URL(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_BASE64URL);
+}
+
+static Value binary_ByteString_toHex(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_HEX);
+}
+
+static Value binary_ByteString__fromBase64(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_STRING, ENCODING_BASE64);
+}
+
+static Value binary_ByteString__fromBase64URL(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_STRING, ENCODING_BASE64URL);
+}
+
+static Value binary_ByteString__fromHex(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_STRING, ENCODING_HEX);
+}
+
+static Value binary_ByteArray_toBase64(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_BASE64);
+}
+
+static Value binary_ByteArray_toBase64URL(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_BASE64URL);
+}
+
+static Value binary_ByteArray_toHex(Value& fnc, Value& ths, Value& arg) {
+	return _encodeString(ths, ENCODING_HEX);
+}
+
+static Value binary_ByteArray__fromBase64(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_ARRAY, ENCODING_BASE64);
+}
+
+static Value binary_ByteArray__fromBase64URL(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_ARRAY, ENCODING_BASE64URL);
+}
+
+static Value binary_ByteArray__fromHex(Value& fnc, Value& ths, Value& arg) {
+	return _decodeString(fnc, arg, BINARY_ARRAY, ENCODING_HEX);
+}
+
+// Returns the statistics of the buffer pool shared by all binaries
+static Value binary_poolStats(Value& fnc, Value& ths, Value& arg) {
+	BufferPoolStats stats;
+	buffer_pool_stats(&stats);
+
+	Value obj = ths.newObject();
+	if (obj.isException()) return obj;
+	obj.set("live",   (double) stats.live);
+	obj.set("cached", (double) stats.cached);
+	obj.set("hits",   (double) stats.hits);
+	obj.set("misses", (double) stats.misses);
+	return obj;
+}
+
+extern "C" bool NATUS_MODULE_INIT(ntValue* base) {
+	Value module(base, false);
+	Value exports = module.get("exports");
+
+	exports.set("Binary", binary_Binary);
+	exports.setRecursive("ByteString",                          binary_ByteString);
+	exports.setRecursive("ByteString.join",                     binary_ByteString__join);
+	exports.setRecursive("ByteString.prototype.toByteArray",    binary_ByteString_toByteArray);
+	exports.setRecursive("ByteString.prototype.toByteString",   binary_ByteString_toByteString);
+	exports.setRecursive("ByteString.prototype.toArray",        binary_ByteString_toArray);
+	exports.setRecursive("ByteString.prototype.readUInt8Array", binary_ByteString_readUInt8Array);
+	exports.setRecursive("ByteString.prototype.readArray",      binary_ByteString_readArray);
+	exports.setRecursive("ByteString.prototype.hash",           binary_ByteString_hash);
+	exports.setRecursive("ByteString.prototype.crc32c",         binary_ByteString_crc32c);
+	exports.setRecursive("ByteString.prototype.indexOf",        binary_ByteString_indexOf);
+	exports.setRecursive("ByteString.prototype.lastIndexOf",    binary_ByteString_lastIndexOf);
+	exports.setRecursive("ByteString.prototype.copy",           binary_ByteString_copy);
+	exports.setRecursive("ByteString.prototype.split",          binary_ByteString_split);
+	exports.setRecursive("ByteString.prototype.slice",          binary_ByteString_slice);
+	exports.setRecursive("ByteString.prototype.concat",         binary_ByteString_concat);
+	exports.setRecursive("ByteString.prototype.substr",         binary_ByteString_substr);
+	exports.setRecursive("ByteString.prototype.substring",      binary_ByteString_substring);
+	exports.setRecursive("ByteString.prototype.toBase64",       binary_ByteString_toBase64);
+	exports.setRecursive("ByteString.prototype.toBase64URL",    binary_ByteString_toBase64URL);
+	exports.setRecursive("ByteString.prototype.toHex",          binary_ByteString_toHex);
+	exports.setRecursive("ByteString.fromBase64",               binary_ByteString__fromBase64);
+	exports.setRecursive("ByteString.fromBase64URL",            binary_ByteString__fromBase64URL);
+	exports.setRecursive("ByteString.fromHex",                  binary_ByteString__fromHex);
+
+	exports.setRecursive("ByteArray",                           binary_ByteArray);
+	exports.setRecursive("ByteArray.join",                      binary_ByteArray__join);
+	exports.setRecursive("ByteArray.prototype.toByteArray",     binary_ByteString_toByteArray);
+	exports.setRecursive("ByteArray.prototype.toByteString",    binary_ByteString_toByteString);
+	exports.setRecursive("ByteArray.prototype.toArray",         binary_ByteArray_toArray);
+	exports.setRecursive("ByteArray.prototype.readUInt8Array",  binary_ByteArray_readUInt8Array);
+	exports.setRecursive("ByteArray.prototype.readArray",       binary_ByteArray_readArray);
+	exports.setRecursive("ByteArray.prototype.writeArray",      binary_ByteArray_writeArray);
+	exports.setRecursive("ByteArray.prototype.hash",            binary_ByteArray_hash);
+	exports.setRecursive("ByteArray.prototype.crc32c",          binary_ByteArray_crc32c);
+	exports.setRecursive("ByteArray.prototype.copy",            binary_ByteArray_copy);
+	exports.setRecursive("ByteArray.prototype.fill",            binary_ByteArray_fill);
+	exports.setRecursive("ByteArray.prototype.concat",          binary_ByteArray_concat);
+	exports.setRecursive("ByteArray.prototype.pop",             binary_ByteArray_pop);
+	exports.setRecursive("ByteArray.prototype.push",            binary_ByteArray_push);
+	exports.setRecursive("ByteArray.prototype.extendRight",     binary_ByteArray_extendRight);
+	exports.setRecursive("ByteArray.prototype.shift",           binary_ByteArray_shift);
+	exports.setRecursive("ByteArray.prototype.unshift",         binary_ByteArray_unshift);
+	exports.setRecursive("ByteArray.prototype.extendLeft",      binary_ByteArray_extendLeft);
+	exports.setRecursive("ByteArray.prototype.reserve",         binary_ByteArray_reserve);
+	exports.setRecursive("ByteArray.prototype.shrinkToFit",     binary_ByteArray_shrinkToFit);
+	exports.setRecursive("ByteArray.prototype.reverse",         binary_ByteArray_reverse);
+	exports.setRecursive("ByteArray.prototype.slice",           binary_ByteArray_slice);
+	exports.setRecursive("ByteArray.prototype.sort",            binary_ByteArray_sort);
+	exports.setRecursive("ByteArray.prototype.indexOf",         binary_ByteArray_indexOf);
+	exports.setRecursive("ByteArray.prototype.lastIndexOf",     binary_ByteArray_lastIndexOf);
+	exports.setRecursive("ByteArray.prototype.split",           binary_ByteArray_split);
+	exports.setRecursive("ByteArray.prototype.filter",          binary_ByteArray_filter);
+	exports.setRecursive("ByteArray.prototype.map",             binary_ByteArray_map);
+	exports.setRecursive("ByteArray.prototype.displace",        binary_ByteArray_displace);
+	exports.setRecursive("ByteArray.prototype.toBase64",        binary_ByteArray_toBase64);
+	exports.setRecursive("ByteArray.prototype.toBase64URL",     binary_ByteArray_toBase64URL);
+	exports.setRecursive("ByteArray.prototype.toHex",           binary_ByteArray_toHex);
+	exports.setRecursive("ByteArray.fromBase64",                binary_ByteArray__fromBase64);
+	exports.setRecursive("ByteArray.fromBase64URL",             binary_ByteArray__fromBase64URL);
+	exports.setRecursive("ByteArray.fromHex",                   binary_ByteArray__fromHex);
+
+	exports.setRecursive("poolStats",                           binary_poolStats);
+
+	exports.setRecursive("Hasher",                              binary_Hasher);
+	exports.setRecursive("Hasher.prototype.digest",             binary_Hasher_digest);
+	exports.setRecursive("Hasher.prototype.reset",              binary_Hasher_reset);
+	exports.setRecursive("Hasher.prototype.update",             binary_Hasher_update);
+	exports.setRecursive("Hasher.prototype.updateFrom",         binary_Hasher_updateFrom);
+
+	// Typed accessors: read*() on both types, write*() on ByteArray only
+	for (size_t i=0 ; i < sizeof(accessors) / sizeof(*accessors) ; i++) {
+		UTF8 name = accessors[i].name;
+		exports.setRecursive("ByteString.prototype.read" + name, accessors[i].read);
+		exports.setRecursive("ByteArray.prototype.read"  + name, accessors[i].read);
+		exports.setRecursive("ByteArray.prototype.write" + name, accessors[i].write);
+	}
 
 	return true;
 }
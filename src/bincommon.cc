@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2010 Nathaniel McCallum <nathaniel@natemccallum.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include <cstdlib>
+#include <new>
+#include <pthread.h>
+#include "bincommon.hpp"
+
+#define BINARY_MIN_GROWTH 64
+
+// Buffers of up to 64KiB (a stream read) come in power of two size classes
+// from 64 bytes up; freed buffers are cached per thread for reuse, up to
+// POOL_CACHE_BYTES per class. Larger buffers go straight to malloc().
+#define POOL_MIN_SHIFT   6
+#define POOL_MAX_SHIFT   16
+#define POOL_CLASSES     (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_LARGE       POOL_CLASSES
+#define POOL_CACHE_BYTES (256 * 1024)
+#define POOL_TAG         0x6C6F6F70 // "pool"
+
+// Precedes every buffer; 16 bytes keep the data 16 byte aligned
+struct BufferHeader {
+	size_t   capacity;
+	uint32_t cls;
+	uint32_t tag;      // POOL_TAG, so stores can tell pool memory apart
+};
+
+struct PoolCache {
+	unsigned char* head[POOL_CLASSES]; // Free buffers, linked through their data
+	size_t         bytes[POOL_CLASSES];
+};
+
+static BufferPoolStats  pool_stats;
+static __thread PoolCache* pool_cache = NULL;
+static pthread_key_t    pool_key;
+static pthread_once_t   pool_once = PTHREAD_ONCE_INIT;
+
+static inline BufferHeader* buffer_header(const unsigned char* buf) {
+	return (BufferHeader*) buf - 1;
+}
+
+// Releases a thread's cached buffers when it exits
+static void pool_cache_free(PoolCache* cache) {
+	for (size_t cls=0 ; cls < POOL_CLASSES ; cls++) {
+		while (cache->head[cls]) {
+			unsigned char* buf = cache->head[cls];
+			cache->head[cls] = *(unsigned char**) buf;
+			free(buffer_header(buf));
+		}
+		__sync_sub_and_fetch(&pool_stats.cached, cache->bytes[cls]);
+	}
+	pool_cache = NULL;
+	delete cache;
+}
+
+static void pool_init() {
+	pthread_key_create(&pool_key, (void (*)(void*)) pool_cache_free);
+}
+
+static PoolCache* pool_get() {
+	if (!pool_cache) {
+		pthread_once(&pool_once, pool_init);
+		pool_cache = new PoolCache;
+		memset(pool_cache, 0, sizeof(PoolCache));
+		pthread_setspecific(pool_key, pool_cache);
+	}
+	return pool_cache;
+}
+
+static size_t pool_class(size_t len) {
+	size_t cls = 0;
+	while (cls < POOL_CLASSES && ((size_t) 1 << (cls + POOL_MIN_SHIFT)) < len)
+		cls++;
+	return cls;
+}
+
+// Allocates a buffer of at least len bytes, to be released with free_buffer()
+unsigned char* alloc_buffer(size_t len) {
+	size_t cls = pool_class(len);
+	if (cls < POOL_CLASSES) {
+		PoolCache*     cache = pool_get();
+		unsigned char* buf   = cache->head[cls];
+		if (buf) {
+			size_t cap = buffer_header(buf)->capacity;
+			cache->head[cls]   = *(unsigned char**) buf;
+			cache->bytes[cls] -= cap;
+			__sync_sub_and_fetch(&pool_stats.cached, cap);
+			__sync_add_and_fetch(&pool_stats.live, cap);
+			__sync_add_and_fetch(&pool_stats.hits, 1);
+			return buf;
+		}
+		len = (size_t) 1 << (cls + POOL_MIN_SHIFT);
+	}
+
+	BufferHeader* hdr = (BufferHeader*) malloc(sizeof(BufferHeader) + len);
+	if (!hdr) throw std::bad_alloc();
+	hdr->capacity = len;
+	hdr->cls      = cls;
+	hdr->tag      = POOL_TAG;
+	__sync_add_and_fetch(&pool_stats.live, len);
+	__sync_add_and_fetch(&pool_stats.misses, 1);
+	return (unsigned char*) (hdr + 1);
+}
+
+void free_buffer(unsigned char *buf) {
+	if (!buf) return;
+
+	BufferHeader* hdr = buffer_header(buf);
+	__sync_sub_and_fetch(&pool_stats.live, hdr->capacity);
+	if (hdr->cls != POOL_LARGE) {
+		PoolCache* cache = pool_get();
+		if (cache->bytes[hdr->cls] + hdr->capacity <= POOL_CACHE_BYTES) {
+			*(unsigned char**) buf   = cache->head[hdr->cls];
+			cache->head[hdr->cls]    = buf;
+			cache->bytes[hdr->cls]  += hdr->capacity;
+			__sync_add_and_fetch(&pool_stats.cached, hdr->capacity);
+			return;
+		}
+	}
+	free(hdr);
+}
+
+// The usable size of a buffer from alloc_buffer(), which may exceed the request
+size_t buffer_capacity(const unsigned char* buf) {
+	return buffer_header(buf)->capacity;
+}
+
+void buffer_pool_stats(BufferPoolStats* stats) {
+	stats->live   = __sync_add_and_fetch(&pool_stats.live,   0);
+	stats->cached = __sync_add_and_fetch(&pool_stats.cached, 0);
+	stats->hits   = __sync_add_and_fetch(&pool_stats.hits,   0);
+	stats->misses = __sync_add_and_fetch(&pool_stats.misses, 0);
+}
+
+static BinaryStore* store_new(unsigned char* buf, size_t size, FreeFunction free, void* owner) {
+	BinaryStore* store = new BinaryStore;
+	store->data   = buf;
+	store->size   = buf ? size : 0;
+	store->free   = buf ? free : NULL;
+	store->owner  = owner;
+	store->refs   = 1;
+	store->pooled = buf && !owner && free == (FreeFunction) free_buffer
+			&& buffer_header(buf)->tag == POOL_TAG;
+	return store;
+}
+
+static void store_unref(BinaryStore* store) {
+	if (__sync_sub_and_fetch(&store->refs, 1) > 0) return;
+	if (store->free) store->free(store->owner ? store->owner : store->data);
+	delete store;
+}
+
+static void binary_free(Binary* bin) {
+	if (bin->store) store_unref(bin->store);
+	delete bin;
+}
+
+// Points bin at store (whose reference we take over) from offset on
+static void binary_point(Binary* bin, BinaryStore* store, size_t offset) {
+	BinaryStore* old = bin->store;
+	bin->store  = store;
+	bin->offset = offset;
+	bin->data   = store->data ? store->data + offset : NULL;
+	if (old) store_unref(old);
+}
+
+static bool binary_attach(Value& obj, BinaryStore* store, size_t offset, size_t len) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	if (!bin) {
+		store_unref(store);
+		return false;
+	}
+
+	binary_point(bin, store, offset);
+	bin->length = len;
+	obj.set("length", (double) len, Value::PropAttrProtected);
+	return true;
+}
+
+// Gives obj the contents of buf, which is released with free (if set)
+bool binary_assign(Value& obj, unsigned char* buf, size_t len, FreeFunction free, void* owner) {
+	return binary_attach(obj, store_new(buf, len, free, owner), 0, len);
+}
+
+// Makes obj a copy-on-write view of len bytes of src starting at off.
+// Memory that belongs to someone else (e.g. a mapping) is only shared
+// between ByteStrings; anything else gets a copy.
+bool binary_share(Value& obj, const Value& src, size_t off, size_t len) {
+	Binary* bin = src.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	if (!bin || !bin->data) return binary_assign(obj, NULL, 0);
+
+	if (!bin->store->pooled &&
+			(binary_type(src) != BINARY_STRING || binary_type(obj) != BINARY_STRING)) {
+		unsigned char* tmp = alloc_buffer(len);
+		memcpy(tmp, bin->data + off, len);
+		return binary_assign(obj, tmp, len);
+	}
+
+	__sync_add_and_fetch(&bin->store->refs, 1);
+	return binary_attach(obj, bin->store, bin->offset + off, len);
+}
+
+// Moves the start of obj by shift bytes and sets its length, which must
+// stay within the capacity reserved by binary_reserve()
+void binary_resize(Value& obj, ssize_t shift, size_t len) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	if (!bin) return;
+
+	bin->offset += shift;
+	bin->data   += shift;
+	bin->length  = len;
+	obj.set("length", (double) len, Value::PropAttrProtected);
+}
+
+// Wraps buf in a new ByteString/ByteArray, which frees it with free (if set)
+Value binary_new(const Value& ctx, BinaryType type, unsigned char* buf, size_t len, FreeFunction free, void* owner) {
+	Binary* bin = new Binary;
+	memset(bin, 0, sizeof(Binary));
+
+	Value obj = ctx.newObject(type == BINARY_ARRAY ? new BinaryArrayClass(bin) : new BinaryStringClass(bin));
+	if (obj.isException() || !obj.setPrivate(PRIV_BINARY_BUFFER, bin, (FreeFunction) binary_free)) {
+		delete bin;
+		if (free && buf) free(owner ? owner : buf);
+		return obj;
+	}
+
+	obj.setPrivate(PRIV_BINARY_TYPE, (void*) type);
+	binary_assign(obj, buf, len, free, owner);
+	return obj;
+}
+
+BinaryType binary_type(const Value& obj) {
+	if (!obj.isObject()) return BINARY_NONE;
+	return (BinaryType) obj.getPrivate<long>(PRIV_BINARY_TYPE);
+}
+
+unsigned char* binary_buffer(const Value& obj, size_t* len) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	unsigned char* buf = bin ? bin->data : NULL;
+	if (len) *len = buf ? bin->length : 0;
+	return buf;
+}
+
+// Like binary_buffer(), but first takes a private copy if the memory is shared
+unsigned char* binary_mutable(const Value& obj, size_t* len) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	size_t  cnt;
+	unsigned char* buf = binary_buffer(obj, &cnt);
+	if (buf && bin->store->refs > 1) {
+		unsigned char* tmp = alloc_buffer(cnt);
+		memcpy(tmp, buf, cnt);
+		binary_point(bin, store_new(tmp, buffer_capacity(tmp), (FreeFunction) free_buffer, NULL), 0);
+		buf = tmp;
+	}
+
+	if (len) *len = cnt;
+	return buf;
+}
+
+// Like binary_mutable(), but also guarantees room for head bytes before and
+// tail bytes after the contents. Space grows geometrically in whichever
+// direction is short, so repeated appends or prepends are amortized O(1).
+unsigned char* binary_reserve(const Value& obj, size_t head, size_t tail) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	if (!bin) return NULL;
+
+	size_t len;
+	unsigned char* buf   = binary_buffer(obj, &len);
+	BinaryStore*   store = bin->store;
+	if (store->refs == 1 && store->pooled
+			&& bin->offset >= head && store->size - bin->offset - len >= tail)
+		return buf;
+
+	size_t grow = len < BINARY_MIN_GROWTH ? BINARY_MIN_GROWTH : len;
+	if (head) head = head < grow ? grow : head;
+	if (tail) tail = tail < grow ? grow : tail;
+
+	unsigned char* tmp = alloc_buffer(head + len + tail);
+	if (buf) memcpy(tmp + head, buf, len);
+	binary_point(bin, store_new(tmp, buffer_capacity(tmp), (FreeFunction) free_buffer, NULL), head);
+	return tmp + head;
+}
+
+// Releases any spare capacity held by obj
+bool binary_compact(const Value& obj) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	size_t  len;
+	unsigned char* buf = binary_buffer(obj, &len);
+	if (!buf || bin->store->refs > 1 || !bin->store->pooled || buffer_capacity(bin->store->data) == len)
+		return false;
+
+	// The pool would round len back up to its size class, so an exact fit
+	// has to come from malloc()
+	unsigned char* tmp = len > 0 ? (unsigned char*) malloc(len) : NULL;
+	if (len > 0 && !tmp) return false;
+	if (len > 0) memcpy(tmp, buf, len);
+	binary_point(bin, store_new(tmp, len, (FreeFunction) free, NULL), 0);
+	return true;
+}
+
+// Returns the owner of the memory obj currently points into, provided it
+// is released with free; NULL if the memory has since been replaced
+void* binary_owner(const Value& obj, FreeFunction free) {
+	Binary* bin = obj.getPrivate<Binary*>(PRIV_BINARY_BUFFER);
+	if (!bin || !bin->store || bin->store->free != free) return NULL;
+	return bin->store->owner;
+}
+
+// Returns len bytes of obj starting at off as a new binary of the given
+// type (by default that of obj), sharing the memory where possible
+Value binary_slice(const Value& obj, size_t off, size_t len, BinaryType type) {
+	Value slice = binary_new(obj, type == BINARY_NONE ? binary_type(obj) : type, NULL, 0);
+	if (!slice.isException())
+		binary_share(slice, obj, off, len);
+	return slice;
+}
+
+// Parses the (buffer, [offset], [length]) arguments starting at arg[first]
+Value binary_range(Value& arg, long first, bool mutate, unsigned char** buf, size_t* len) {
+	BinaryType type = binary_type(arg[first]);
+	if (type == BINARY_NONE || (mutate && type != BINARY_ARRAY))
+		return throwException(arg, "TypeError", mutate
+				? "Argument must be a ByteArray!"
+				: "Argument must be a ByteString or ByteArray!");
+
+	size_t  total;
+	unsigned char* data = mutate ? binary_mutable(arg[first], &total) : binary_buffer(arg[first], &total);
+	ssize_t argc = arg.get("length").to<ssize_t>();
+
+	ssize_t off = argc > first+1 ? arg[first+1].to<ssize_t>() : 0;
+	if (off < 0 || (size_t) off > total)
+		return throwException(arg, "RangeError", "Offset is outside of the buffer!");
+
+	ssize_t cnt = argc > first+2 ? arg[first+2].to<ssize_t>() : total - off;
+	if (cnt < 0 || (size_t) cnt > total - off)
+		return throwException(arg, "RangeError", "Length extends past the end of the buffer!");
+
+	*buf = data ? data + off : NULL;
+	*len = cnt;
+	return arg.newUndefined();
+}
+
+// Describes an array of ByteStrings/ByteArrays (at most IOV_MAX of them) as
+// iovecs for scatter/gather I/O
+Value binary_iovec(const Value& list, bool mutate, std::vector<struct iovec>& iov) {
+	if (!list.isArray())
+		return throwException(list, "TypeError", "Argument must be an array of buffers!");
+
+	// Quietly transferring only part of the list would look like success
+	size_t cnt = list.get("length").to<size_t>();
+	if (cnt > IOV_MAX)
+		return throwException(list, "RangeError", "Too many buffers for one call!");
+
+	iov.resize(cnt);
+	for (size_t i=0 ; i < cnt ; i++) {
+		Value item = list[i];
+		BinaryType type = binary_type(item);
+		if (type == BINARY_NONE || (mutate && type != BINARY_ARRAY))
+			return throwException(list, "TypeError", mutate
+					? "Array items must be ByteArrays!"
+					: "Array items must be ByteStrings or ByteArrays!");
+
+		size_t len;
+		iov[i].iov_base = mutate ? binary_mutable(item, &len) : binary_buffer(item, &len);
+		iov[i].iov_len  = len;
+	}
+	return list.newUndefined();
+}
+
+Class::Flags BinaryStringClass::getFlags () {
+	return Class::FlagObject;
+}
+
+Value BinaryStringClass::del(Value& obj, Value& name) {
+	if (!name.isNumber()) return NULL;
+	return throwException(obj, "IndexError", "ByteStrings are immutable!");
+}
+
+Value BinaryStringClass::set(Value& obj, Value& name, Value& value) {
+	if (!name.isNumber()) return NULL;
+	return throwException(obj, "IndexError", "ByteStrings are immutable!");
+}
+
+Value BinaryStringClass::get(Value& obj, Value& name) {
+	if (!name.isNumber()) return NULL;
+
+	ssize_t idx = name.to<ssize_t>();
+	ssize_t len = bin->length;
+	if (idx < 0) idx += len; // Convert -1 to (len-1)
+	if (idx < 0)    return throwException(obj, "IndexError", "Negative index is before the start of the array!");
+	if (idx >= len) return obj.newUndefined();
+
+	return obj.newNumber(bin->data[idx]);
+}
+
+Value BinaryStringClass::enumerate(Value& obj) {
+	size_t len = bin->length;
+
+	Value items = obj.newArray();
+	for (size_t i=0 ; i < len ; i++)
+		arrayBuilder(items, (double) i);
+
+	return items;
+}
+
+Value BinaryArrayClass::del(Value& obj, Value& name) {
+	if (!name.isNumber()) return NULL;
+
+	ssize_t idx = name.to<ssize_t>();
+	ssize_t len = bin->length;
+	if (idx < 0) idx += len; // Convert -1 to (len-1)
+	if (idx < 0)    return throwException(obj, "IndexError", "Negative index is before the start of the array!");
+	if (idx >= len) return obj.newUndefined();
+
+	// Close the gap by moving whichever side is shorter
+	unsigned char* buf = binary_mutable(obj, NULL);
+	if (idx < len / 2) {
+		memmove(buf + 1, buf, idx);
+		binary_resize(obj, 1, len - 1);
+	} else {
+		memmove(buf + idx, buf + idx + 1, len - idx - 1);
+		binary_resize(obj, 0, len - 1);
+	}
+	return obj.newUndefined();
+}
+
+Value BinaryArrayClass::set(Value& obj, Value& name, Value& value) {
+	if (!name.isNumber()) return NULL;
+
+	ssize_t idx = name.to<ssize_t>();
+	ssize_t val = value.to<size_t>();
+	ssize_t len = bin->length;
+	if (idx < 0) idx += len; // Convert -1 to (len-1)
+	if (idx < 0)              return throwException(obj, "IndexError", "Negative index is before the start of the array!");
+	if (!value.isNumber())    return throwException(obj, "TypeError",  "Value must be a number!");
+	if (val < 0 || val > 255) return throwException(obj, "RangeError", "Byte values must be between 0 and 255 inclusive!");
+
+	// Writing past the end grows the array, zero filling any gap
+	unsigned char* buf;
+	if (idx < len && bin->store->refs == 1)
+		buf = bin->data;
+	else if (idx < len)
+		buf = binary_mutable(obj, NULL);
+	else {
+		buf = binary_reserve(obj, 0, idx + 1 - len);
+		memset(buf + len, 0, idx - len);
+		binary_resize(obj, 0, idx + 1);
+	}
+
+	buf[idx] = val;
+	return obj.newUndefined();
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2010 Nathaniel McCallum <nathaniel@natemccallum.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef BINCOMMON_HPP_
+#define BINCOMMON_HPP_
+#include <vector>
+#include <sys/uio.h>
+#define I_ACKNOWLEDGE_THAT_NATUS_IS_NOT_STABLE
+#include <natus/natus.hpp>
+using namespace natus;
+
+#define PRIV_BINARY_BUFFER "commonjs::binary"
+#define PRIV_BINARY_TYPE   "commonjs::binary::type"
+
+enum BinaryType {
+	BINARY_NONE,
+	BINARY_STRING,
+	BINARY_ARRAY
+};
+
+// Reference counted memory, shared copy-on-write between binary objects
+struct BinaryStore {
+	unsigned char* data;
+	size_t         size;  // Capacity of data
+	FreeFunction   free;  // Releases owner (or data if unset); NULL if not ours
+	void*          owner;
+	long           refs;
+	bool           pooled; // data is ours, from alloc_buffer()
+};
+
+// The private state of every ByteString/ByteArray; data and length are
+// kept here so that native code never has to go through JS properties
+struct Binary {
+	BinaryStore*   store;
+	size_t         offset;
+	unsigned char* data;   // store->data + offset
+	size_t         length; // Mirrored to the JS "length" property
+};
+
+class BinaryStringClass : public Class {
+public:
+	BinaryStringClass(Binary* bin) : bin(bin) {}
+	virtual Class::Flags getFlags ();
+	virtual Value del(Value& obj, Value& name);
+	virtual Value set(Value& obj, Value& name, Value& value);
+	virtual Value get(Value& obj, Value& name);
+	virtual Value enumerate(Value& obj);
+
+protected:
+	Binary* bin; // Owned by the object's PRIV_BINARY_BUFFER private
+};
+
+class BinaryArrayClass : public BinaryStringClass {
+public:
+	BinaryArrayClass(Binary* bin) : BinaryStringClass(bin) {}
+	virtual Value del(Value& obj, Value& name);
+	virtual Value set(Value& obj, Value& name, Value& value);
+};
+
+// Statistics of the buffer pool, in bytes except for the counts
+struct BufferPoolStats {
+	size_t live;    // Held by live buffers
+	size_t cached;  // Held by freed buffers kept for reuse
+	size_t hits;    // Allocations served from a cache
+	size_t misses;  // Allocations that went to malloc()
+};
+
+unsigned char* alloc_buffer(size_t len);
+void           free_buffer(unsigned char *buf);
+size_t         buffer_capacity(const unsigned char* buf);
+void           buffer_pool_stats(BufferPoolStats* stats);
+Value          binary_new(const Value& ctx, BinaryType type, unsigned char* buf, size_t len, FreeFunction free=(FreeFunction) free_buffer, void* owner=NULL);
+bool           binary_assign(Value& obj, unsigned char* buf, size_t len, FreeFunction free=(FreeFunction) free_buffer, void* owner=NULL);
+bool           binary_share(Value& obj, const Value& src, size_t off, size_t len);
+void           binary_resize(Value& obj, ssize_t shift, size_t len);
+BinaryType     binary_type(const Value& obj);
+unsigned char* binary_buffer(const Value& obj, size_t* len);
+unsigned char* binary_mutable(const Value& obj, size_t* len);
+unsigned char* binary_reserve(const Value& obj, size_t head, size_t tail);
+bool           binary_compact(const Value& obj);
+void*          binary_owner(const Value& obj, FreeFunction free);
+Value          binary_slice(const Value& obj, size_t off, size_t len, BinaryType type=BINARY_NONE);
+Value          binary_range(Value& arg, long first, bool mutate, unsigned char** buf, size_t* len);
+Value          binary_iovec(const Value& list, bool mutate, std::vector<struct iovec>& iov);
+
+#endif /* BINCOMMON_HPP_ */
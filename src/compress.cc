@@ -0,0 +1,506 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+#include <zlib.h>
+#include "iocommon.hpp"
+#include "bincommon.hpp"
+
+#define PRIV_COMPRESS_CODEC "compress::codec"
+
+// zlib counts in uInt, so larger buffers are fed to it in pieces
+#define ZCHUNK(n) ((uInt) std::min((size_t) (n), (size_t) UINT_MAX))
+
+// Returned by the stream helpers when zlib rejects the data
+#define CODEC_DATA_ERROR -2
+
+struct Codec {
+	z_stream       zs;
+	bool           deflating;
+	bool           finished;  // Decompressors: the end of the data was seen
+	unsigned char* buf;       // Reused between calls: compressed output when
+	size_t         size;      // deflating, compressed input when inflating
+	size_t         pend;      // Compressors: output in buf the stream has
+	size_t         pendoff;   // not taken yet, starting at buf + pendoff
+	unsigned char* held;      // Compressors: string input accepted while
+	size_t         heldlen;   // the stream was blocked, which zlib has not
+	size_t         heldoff;   // taken yet, starting at held + heldoff
+};
+
+static void codec_free(Codec* codec) {
+	if (codec->deflating) deflateEnd(&codec->zs);
+	else                  inflateEnd(&codec->zs);
+	delete[] codec->buf;
+	free(codec->held);
+	delete codec;
+}
+
+// Keeps a copy of input that zlib couldn't take yet
+static bool _hold(Codec* codec, const unsigned char* buf, size_t len) {
+	if (codec->heldoff > 0) {
+		memmove(codec->held, codec->held + codec->heldoff, codec->heldlen);
+		codec->heldoff = 0;
+	}
+
+	unsigned char* tmp = (unsigned char*) realloc(codec->held, codec->heldlen + len);
+	if (!tmp) return false;
+	memcpy(tmp + codec->heldlen, buf, len);
+	codec->held     = tmp;
+	codec->heldlen += len;
+	return true;
+}
+
+static Codec* codec_get(Value& obj, bool deflating) {
+	Codec* codec = obj.getPrivate<Codec*>(PRIV_COMPRESS_CODEC);
+	return codec && codec->deflating == deflating ? codec : NULL;
+}
+
+// Maps a format name to zlib's windowBits; "auto" accepts zlib or gzip headers
+static bool _window(const UTF8& format, bool deflating, int* bits) {
+	if (format == "deflate")
+		*bits = MAX_WBITS;
+	else if (format == "raw")
+		*bits = -MAX_WBITS;
+	else if (format == "gzip")
+		*bits = MAX_WBITS + 16;
+	else if (format == "auto" && !deflating)
+		*bits = MAX_WBITS + 32;
+	else
+		return false;
+	return true;
+}
+
+// Gets the bytes of a ByteString, ByteArray or string (as UTF-8)
+static bool _input(const Value& data, UTF8& tmp, const unsigned char** buf, size_t* len) {
+	if (binary_type(data) != BINARY_NONE) {
+		*buf = binary_buffer(data, len);
+		return true;
+	}
+
+	if (!data.isString()) return false;
+	tmp  = data.to<UTF8>();
+	*buf = (const unsigned char*) tmp.data();
+	*len = tmp.length();
+	return true;
+}
+
+static Value _zerror(Value& ctx, int status) {
+	if (status == Z_MEM_ERROR) return throwException(ctx, ENOMEM);
+	return throwException(ctx, "ValueError", "Invalid or truncated compressed data!");
+}
+
+// Sends the codec's pending output to the stream. Whatever the stream
+// won't take stays pending; -1 is returned (EAGAIN if it would block).
+static int _emit(Codec* codec, Stream* stream) {
+	while (codec->pend > 0) {
+		ssize_t snt = stream_write(stream, (const char*) codec->buf + codec->pendoff, codec->pend);
+		if (snt == 0) errno = EAGAIN;
+		if (snt <= 0) return -1;
+		codec->pendoff += snt;
+		codec->pend    -= snt;
+	}
+	return 0;
+}
+
+// Runs the compressor over its pending input, sending the output to the
+// stream through the codec's buffer until the input is consumed (and,
+// for Z_SYNC_FLUSH/Z_FINISH, the flush is complete). If the stream stops
+// taking output, -1 is returned and the rest is sent by the next call.
+static int _deflatePump(Codec* codec, Stream* stream, int flush) {
+	// The buffer can't be reused until the last call's output is out
+	if (_emit(codec, stream) < 0) return -1;
+
+	for (;;) {
+		codec->zs.next_out  = codec->buf;
+		codec->zs.avail_out = codec->size;
+
+		int status = deflate(&codec->zs, flush);
+		if (status == Z_STREAM_ERROR) return CODEC_DATA_ERROR;
+		codec->pend    = codec->size - codec->zs.avail_out;
+		codec->pendoff = 0;
+		if (_emit(codec, stream) < 0) return -1;
+
+		if (flush == Z_FINISH ? status == Z_STREAM_END : codec->zs.avail_out != 0)
+			return 0;
+	}
+}
+
+// Decompresses up to len bytes into out, reading compressed data into the
+// codec's buffer as needed. Once some output is produced it returns rather
+// than block for more input. Returns the bytes produced (0 at the end of
+// the data), -1 on a stream error or CODEC_DATA_ERROR.
+static ssize_t _inflateInto(Codec* codec, Stream* stream, unsigned char* out, size_t len) {
+	size_t done = 0;
+	while (!codec->finished && done < len) {
+		codec->zs.next_out  = out + done;
+		codec->zs.avail_out = ZCHUNK(len - done);
+
+		uInt avail  = codec->zs.avail_out;
+		int  status = inflate(&codec->zs, Z_NO_FLUSH);
+		done += avail - codec->zs.avail_out;
+		if (status == Z_STREAM_END)
+			codec->finished = true;
+		else if (status == Z_MEM_ERROR) {
+			errno = ENOMEM;
+			return -1;
+		} else if (status != Z_OK && status != Z_BUF_ERROR)
+			return CODEC_DATA_ERROR;
+		else if (codec->zs.avail_in == 0 && done == 0) {
+			ssize_t rcvd = stream_read(stream, codec->buf, codec->size);
+			if (rcvd < 0)  return -1;
+			if (rcvd == 0) return CODEC_DATA_ERROR;
+			codec->zs.next_in  = codec->buf;
+			codec->zs.avail_in = rcvd;
+		} else if (codec->zs.avail_in == 0)
+			break;
+	}
+	return done;
+}
+
+// Handles deflate(data, [level], [format])
+static Value compress_deflate(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(so)|ns");
+
+	long argc  = arg.get("length").to<long>();
+	int  level = argc > 1 ? arg[1].to<int>() : Z_DEFAULT_COMPRESSION;
+	int  bits;
+	if (!_window(argc > 2 ? arg[2].to<UTF8>() : "deflate", true, &bits))
+		return throwException(ths, "ValueError", "Format must be one of 'deflate', 'raw' or 'gzip'!");
+
+	UTF8                 tmp;
+	const unsigned char* src;
+	size_t               len;
+	if (!_input(arg[0], tmp, &src, &len))
+		return throwException(ths, "TypeError", "Data must be a ByteString, ByteArray or string!");
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	int status = deflateInit2(&zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+	if (status == Z_STREAM_ERROR)
+		return throwException(ths, "RangeError", "Compression level must be between -1 and 9!");
+	if (status != Z_OK)
+		return _zerror(ths, status);
+
+	// The bound is exact enough to compress in one pass into one allocation
+	size_t         size = deflateBound(&zs, len);
+	unsigned char* buf  = alloc_buffer(size);
+	size_t         inleft = len, outleft = size;
+	zs.next_in  = (Bytef*) src;
+	zs.next_out = buf;
+	do {
+		zs.avail_in  = ZCHUNK(inleft);
+		zs.avail_out = ZCHUNK(outleft);
+		uInt ai = zs.avail_in, ao = zs.avail_out;
+		status = deflate(&zs, inleft == ai ? Z_FINISH : Z_NO_FLUSH);
+		inleft  -= ai - zs.avail_in;
+		outleft -= ao - zs.avail_out;
+	} while (status == Z_OK);
+	deflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		free_buffer(buf);
+		return _zerror(ths, status);
+	}
+	return binary_new(ths, BINARY_STRING, buf, size - outleft);
+}
+
+// Handles inflate(data, [format])
+static Value compress_inflate(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(so)|s");
+
+	int bits;
+	if (!_window(arg.get("length").to<long>() > 1 ? arg[1].to<UTF8>() : "auto", false, &bits))
+		return throwException(ths, "ValueError", "Format must be one of 'auto', 'deflate', 'raw' or 'gzip'!");
+
+	UTF8                 tmp;
+	const unsigned char* src;
+	size_t               len;
+	if (!_input(arg[0], tmp, &src, &len))
+		return throwException(ths, "TypeError", "Data must be a ByteString, ByteArray or string!");
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	int status = inflateInit2(&zs, bits);
+	if (status != Z_OK)
+		return _zerror(ths, status);
+
+	// Guess the output size and grow it geometrically
+	size_t         size = std::max(len * 4, (size_t) 1024);
+	unsigned char* buf  = alloc_buffer(size);
+	size_t         inleft = len, done = 0;
+	zs.next_in = (Bytef*) src;
+	do {
+		if (done == size) {
+			unsigned char* tmp = alloc_buffer(size * 2);
+			memcpy(tmp, buf, done);
+			free_buffer(buf);
+			buf   = tmp;
+			size *= 2;
+		}
+
+		zs.next_out  = buf + done;
+		zs.avail_in  = ZCHUNK(inleft);
+		zs.avail_out = ZCHUNK(size - done);
+		uInt ai = zs.avail_in, ao = zs.avail_out;
+		status = inflate(&zs, Z_NO_FLUSH);
+		inleft -= ai - zs.avail_in;
+		done   += ao - zs.avail_out;
+	} while (status == Z_OK || (status == Z_BUF_ERROR && done == size));
+	inflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		free_buffer(buf);
+		return _zerror(ths, status);
+	}
+	return binary_new(ths, BINARY_STRING, buf, done);
+}
+
+static Value _codec(Value& fnc, const Value& stream, Codec* codec) {
+	codec->buf = new unsigned char[codec->size = STREAM_BUFFER_SIZE];
+
+	Value obj = fnc.newObject();
+	if (obj.isException()) {
+		codec_free(codec);
+		return obj;
+	}
+	if (!obj.setPrivate(PRIV_COMPRESS_CODEC, codec, (FreeFunction) codec_free)) {
+		codec_free(codec);
+		return throwException(fnc, "Error", "Unable to create codec!");
+	}
+
+	// Keep the stream alive for as long as we are
+	obj.set("__proto__", fnc.get("prototype"));
+	obj.set("stream", stream, Value::PropAttrConstant);
+	return obj;
+}
+
+// Handles Compressor(stream, [level], [format])
+static Value compress_Compressor(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|ns");
+	if (!stream_get(arg[0]))
+		return throwException(fnc, "TypeError", "Argument must be a stream!");
+
+	long argc  = arg.get("length").to<long>();
+	int  level = argc > 1 ? arg[1].to<int>() : Z_DEFAULT_COMPRESSION;
+	int  bits;
+	if (!_window(argc > 2 ? arg[2].to<UTF8>() : "deflate", true, &bits))
+		return throwException(fnc, "ValueError", "Format must be one of 'deflate', 'raw' or 'gzip'!");
+
+	Codec* codec = new Codec;
+	memset(codec, 0, sizeof(Codec));
+	codec->deflating = true;
+	int status = deflateInit2(&codec->zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+	if (status != Z_OK) {
+		delete codec;
+		if (status == Z_STREAM_ERROR)
+			return throwException(fnc, "RangeError", "Compression level must be between -1 and 9!");
+		return _zerror(fnc, status);
+	}
+
+	return _codec(fnc, arg[0], codec);
+}
+
+// Handles Decompressor(stream, [format])
+static Value compress_Decompressor(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|s");
+	if (!stream_get(arg[0]))
+		return throwException(fnc, "TypeError", "Argument must be a stream!");
+
+	int bits;
+	if (!_window(arg.get("length").to<long>() > 1 ? arg[1].to<UTF8>() : "auto", false, &bits))
+		return throwException(fnc, "ValueError", "Format must be one of 'auto', 'deflate', 'raw' or 'gzip'!");
+
+	Codec* codec = new Codec;
+	memset(codec, 0, sizeof(Codec));
+	int status = inflateInit2(&codec->zs, bits);
+	if (status != Z_OK) {
+		delete codec;
+		return _zerror(fnc, status);
+	}
+
+	return _codec(fnc, arg[0], codec);
+}
+
+// Runs the compressor with the given flush mode, returning true once all
+// the output is with the stream and false if the stream would block
+static Value _deflateStream(Value& ths, Codec* codec, int flush) {
+	Stream* stream = stream_get(ths.get("stream"));
+	if (!stream) return throwException(ths, EBADF);
+
+	// Held input comes before anything new, so write() calls made while
+	// it is held leave zlib's input alone
+	int status = 0;
+	while (status == 0 && codec->heldlen > 0) {
+		codec->zs.next_in  = codec->held + codec->heldoff;
+		codec->zs.avail_in = ZCHUNK(codec->heldlen);
+
+		uInt avail = codec->zs.avail_in;
+		status = _deflatePump(codec, stream, Z_NO_FLUSH);
+		codec->heldoff += avail - codec->zs.avail_in;
+		codec->heldlen -= avail - codec->zs.avail_in;
+		codec->zs.avail_in = 0;
+	}
+	if (status == 0 && codec->held) {
+		free(codec->held);
+		codec->held    = NULL;
+		codec->heldoff = 0;
+	}
+
+	if (status == 0)
+		status = _deflatePump(codec, stream, flush);
+	if (status == CODEC_DATA_ERROR)
+		return throwException(ths, "Error", "Compressor is in an invalid state!");
+	if (status == 0 && flush != Z_NO_FLUSH)
+		status = stream_flush(stream);
+	if (status < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newBoolean(false) : throwException(ths, errno);
+	return ths.newBoolean(true);
+}
+
+// Handles write(data): compresses data onto the stream, returning the
+// number of bytes consumed. If the stream would block, that is short (or
+// 0) for a ByteString or ByteArray, so the rest can be sliced off and
+// written again. A string is always taken whole, with the rest held
+// until the next write(), flush() or finish().
+static Value compress_Compressor_write(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(so)");
+	Codec* codec = codec_get(ths, true);
+	if (!codec) return throwException(ths, "TypeError", "Not a Compressor!");
+
+	UTF8                 tmp;
+	const unsigned char* src;
+	size_t               len;
+	if (!_input(arg[0], tmp, &src, &len))
+		return throwException(ths, "TypeError", "Data must be a ByteString, ByteArray or string!");
+
+	// Sends out what earlier calls left behind first
+	Value  rslt = _deflateStream(ths, codec, Z_NO_FLUSH);
+	size_t left = len;
+	codec->zs.next_in = (Bytef*) src;
+	while (left > 0 && !rslt.isException() && rslt.to<bool>()) {
+		uInt avail = codec->zs.avail_in = ZCHUNK(left);
+		rslt  = _deflateStream(ths, codec, Z_NO_FLUSH);
+		left -= avail - codec->zs.avail_in;
+	}
+
+	// Don't keep pointing into the caller's data
+	codec->zs.avail_in = 0;
+	if (rslt.isException()) return rslt;
+
+	// Positions in a string don't match its UTF-8 bytes, so a string
+	// can't be resumed by the caller; keep the rest ourselves
+	if (left > 0 && binary_type(arg[0]) == BINARY_NONE) {
+		if (!_hold(codec, src + len - left, left))
+			return throwException(ths, ENOMEM);
+		left = 0;
+	}
+	return ths.newNumber(len - left);
+}
+
+// Pushes out everything written so far so the reader can decompress it;
+// returns false if the stream would block, so call it again when writable
+static Value compress_Compressor_flush(Value& fnc, Value& ths, Value& arg) {
+	Codec* codec = codec_get(ths, true);
+	if (!codec) return throwException(ths, "TypeError", "Not a Compressor!");
+	return _deflateStream(ths, codec, Z_SYNC_FLUSH);
+}
+
+// Ends the compressed data (writing any trailer); later writes start anew.
+// Returns false if the stream would block, so call it again when writable.
+static Value compress_Compressor_finish(Value& fnc, Value& ths, Value& arg) {
+	Codec* codec = codec_get(ths, true);
+	if (!codec) return throwException(ths, "TypeError", "Not a Compressor!");
+
+	Value rslt = _deflateStream(ths, codec, Z_FINISH);
+	if (!rslt.isException() && !rslt.to<bool>())
+		return rslt;
+	deflateReset(&codec->zs);
+	free(codec->held);
+	codec->held    = NULL;
+	codec->heldlen = codec->heldoff = 0;
+	codec->pend    = 0;
+	return rslt;
+}
+
+static Value _inflateStream(Value& ths, Codec* codec, unsigned char* buf, size_t len, ssize_t* rcvd) {
+	Stream* stream = stream_get(ths.get("stream"));
+	if (!stream) return throwException(ths, EBADF);
+
+	*rcvd = _inflateInto(codec, stream, buf, len);
+	if (*rcvd == CODEC_DATA_ERROR)
+		return _zerror(ths, Z_DATA_ERROR);
+	if (*rcvd < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return ths;
+}
+
+// Handles read([max]): returns up to max decompressed bytes as a
+// ByteString (empty at the end of the data, null if it would block)
+static Value compress_Decompressor_read(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+	Codec* codec = codec_get(ths, false);
+	if (!codec) return throwException(ths, "TypeError", "Not a Decompressor!");
+
+	// An empty result means the end of the data, so it can't be asked for
+	long max = arg.get("length").to<long>() > 0 ? arg[0].to<long>() : STREAM_BUFFER_SIZE;
+	if (max <= 0)
+		return throwException(ths, "RangeError", "Read size must be greater than zero!");
+
+	size_t         len = max;
+	unsigned char* buf = alloc_buffer(len);
+	ssize_t        rcvd;
+	Value rslt = _inflateStream(ths, codec, buf, len, &rcvd);
+	if (rcvd < 0) {
+		free_buffer(buf);
+		return rslt;
+	}
+	return binary_new(ths, BINARY_STRING, buf, rcvd);
+}
+
+// Handles readInto(byteArray, [start], [end]): decompresses straight into
+// the array, returning the bytes written (null if it would block)
+static Value compress_Decompressor_readInto(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|nn");
+	Codec* codec = codec_get(ths, false);
+	if (!codec) return throwException(ths, "TypeError", "Not a Decompressor!");
+
+	unsigned char* buf;
+	size_t         len;
+	Value rslt = binary_range(arg, 0, true, &buf, &len);
+	if (rslt.isException()) return rslt;
+
+	ssize_t rcvd;
+	rslt = _inflateStream(ths, codec, buf, len, &rcvd);
+	if (rcvd < 0) return rslt;
+	return ths.newNumber(rcvd);
+}
+
+#define OK(x) ok = (!x.isException()) || ok
+#define NCONST(macro) OK(mod.setRecursive("exports." # macro, macro))
+
+extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
+	Value mod(module, false);
+	bool ok = false;
+
+	// Functions
+	OK(mod.setRecursive("exports.deflate", compress_deflate));
+	OK(mod.setRecursive("exports.inflate", compress_inflate));
+
+	// Objects
+	OK(mod.setRecursive("exports.Compressor",                      compress_Compressor));
+	OK(mod.setRecursive("exports.Compressor.prototype.finish",     compress_Compressor_finish));
+	OK(mod.setRecursive("exports.Compressor.prototype.flush",      compress_Compressor_flush));
+	OK(mod.setRecursive("exports.Compressor.prototype.write",      compress_Compressor_write));
+	OK(mod.setRecursive("exports.Decompressor",                    compress_Decompressor));
+	OK(mod.setRecursive("exports.Decompressor.prototype.read",     compress_Decompressor_read));
+	OK(mod.setRecursive("exports.Decompressor.prototype.readInto", compress_Decompressor_readInto));
+
+	// Constants
+	NCONST(Z_BEST_COMPRESSION);
+	NCONST(Z_BEST_SPEED);
+	NCONST(Z_DEFAULT_COMPRESSION);
+	NCONST(Z_NO_COMPRESSION);
+
+	return ok;
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2010 Nathaniel McCallum <nathaniel@natemccallum.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sys/epoll.h>
+#include "iocommon.hpp"
+using namespace std;
+
+#define PRIV_EVENT_LOOP "event::loop"
+#define LOOP_MAX_EVENTS 1024
+
+// One registered target. Streams are watched by identity rather than by
+// fd, since a stream closed without remove() frees its fd for reuse.
+struct Watch {
+	int      fd;
+	Stream*  stream;  // NULL for raw fds
+	uint32_t events;
+};
+
+struct Loop {
+	int  epfd;
+	bool stop;
+	long next;                    // Id for the next watch, kept in epoll's data
+	map<long, Watch>    watches;  // By id; its size is what run() waits on
+	map<Stream*, long>  streams;  // Ids of the stream targets
+	map<int, long>      fds;      // Ids of the raw fd targets
+};
+
+static void loop_free(Loop* loop) {
+	close(loop->epfd);
+	delete loop;
+}
+
+static UTF8 _key(long id) {
+	char key[21];
+	snprintf(key, sizeof(key), "%ld", id);
+	return key;
+}
+
+// Finds the watch for a raw fd or any object made by stream_from_fd(),
+// returning its id (or -1). Also gets the target's fd and stream.
+static long _find(Loop* loop, const Value& target, int* fd, Stream** stream) {
+	*stream = target.isObject() ? stream_get(target) : NULL;
+	*fd     = *stream ? (*stream)->fd : target.isNumber() ? target.to<int>() : -1;
+
+	if (*stream) {
+		map<Stream*, long>::iterator it = loop->streams.find(*stream);
+		return it == loop->streams.end() ? -1 : it->second;
+	}
+	map<int, long>::iterator it = loop->fds.find(*fd);
+	return it == loop->fds.end() ? -1 : it->second;
+}
+
+// Forgets a watch; its fd must already be out of epoll (or closed)
+static void _unwatch(Value& ths, Loop* loop, long id) {
+	map<long, Watch>::iterator it = loop->watches.find(id);
+	if (it == loop->watches.end()) return;
+
+	if (it->second.stream) loop->streams.erase(it->second.stream);
+	else                   loop->fds.erase(it->second.fd);
+	loop->watches.erase(it);
+	ths.get("handlers").del(_key(id));
+}
+
+// Waits for events and runs their callbacks, returning the number dispatched
+static Value _dispatch(Value& ths, Loop* loop, int timeout) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+
+	// Streams closed without remove() can never fire again, so drop them.
+	// Input already sitting in a stream's buffer never wakes epoll, so
+	// report those streams as readable and only poll for anything else.
+	int b = 0;
+	for (map<long, Watch>::iterator it=loop->watches.begin() ; it != loop->watches.end() ; ) {
+		long    id     = it->first;
+		Stream* stream = it->second.stream;
+		bool    ready  = stream && (it->second.events & EPOLLIN) && stream->rpos < stream->rlen;
+		it++;
+
+		if (stream && stream->fd < 0)
+			_unwatch(ths, loop, id);
+		else if (ready && b < LOOP_MAX_EVENTS) {
+			events[b].events   = EPOLLIN;
+			events[b].data.u64 = id;
+			b++;
+		}
+	}
+	if (loop->watches.empty() && timeout < 0)
+		return ths.newNumber(0);
+
+	int n = 0;
+	if (b < LOOP_MAX_EVENTS) {
+		do {
+			n = epoll_wait(loop->epfd, events + b, LOOP_MAX_EVENTS - b, b > 0 ? 0 : timeout);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) return throwException(ths, errno);
+	}
+
+	// Merge what epoll reported for the streams we already have
+	for (int i=b ; i < b + n ; i++) {
+		int j;
+		for (j=0 ; j < b && events[j].data.u64 != events[i].data.u64 ; j++);
+		if (j < b) {
+			events[j].events |= events[i].events;
+			events[i--] = events[b + --n];
+		}
+	}
+	n += b;
+
+	Value handlers = ths.get("handlers");
+	for (int i=0 ; i < n ; i++) {
+		// An earlier callback may have removed this watch
+		long  id      = events[i].data.u64;
+		Value handler = handlers.get(_key(id));
+		if (!handler.isObject()) continue;
+
+		Value target = handler.get("target");
+		Value args   = arrayBuilder(arrayBuilder(ths, target), (long) events[i].events);
+		Value rslt   = handler.get("callback").call(target, args);
+
+		// A hung up or failed fd would otherwise be reported forever
+		map<long, Watch>::iterator it = loop->watches.find(id);
+		if (it != loop->watches.end() && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+			if (it->second.fd >= 0 && (!it->second.stream || it->second.stream->fd == it->second.fd))
+				epoll_ctl(loop->epfd, EPOLL_CTL_DEL, it->second.fd, NULL);
+			_unwatch(ths, loop, id);
+		}
+		if (rslt.isException()) return rslt;
+	}
+	return ths.newNumber(n);
+}
+
+static Value loop_add(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(no)n");
+
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	int     fd;
+	Stream* stream;
+	if (_find(loop, arg[0], &fd, &stream) >= 0) return throwException(ths, EEXIST);
+	if (fd < 0)               return throwException(ths, "TypeError", "Target must be a file descriptor or a stream!");
+	if (!arg[2].isFunction()) return throwException(ths, "TypeError", "Callback must be a function!");
+
+	long id = loop->next++;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = arg[1].to<int>();
+	ev.data.u64 = id;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return throwException(ths, errno);
+
+	Value handler = ths.newObject();
+	handler.set("target",   arg[0]);
+	handler.set("callback", arg[2]);
+	ths.get("handlers").set(_key(id), handler);
+
+	Watch watch = { fd, stream, ev.events };
+	loop->watches[id] = watch;
+	if (stream) loop->streams[stream] = id;
+	else        loop->fds[fd]         = id;
+	return ths.newUndefined();
+}
+
+static Value loop_modify(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(no)n");
+
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	int     fd;
+	Stream* stream;
+	long    id = _find(loop, arg[0], &fd, &stream);
+	if (fd < 0) return throwException(ths, "TypeError", "Target must be a file descriptor or a stream!");
+	if (id < 0) return throwException(ths, ENOENT);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = arg[1].to<int>();
+	ev.data.u64 = id;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return throwException(ths, errno);
+	loop->watches[id].events = ev.events;
+
+	// Optionally replace the callback
+	if (arg.get("length").to<int>() > 2) {
+		if (!arg[2].isFunction()) return throwException(ths, "TypeError", "Callback must be a function!");
+		ths.get("handlers").get(_key(id)).set("callback", arg[2]);
+	}
+	return ths.newUndefined();
+}
+
+static Value loop_remove(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(no)");
+
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	int     fd;
+	Stream* stream;
+	long    id = _find(loop, arg[0], &fd, &stream);
+	if (id < 0 && fd < 0 && !stream)
+		return throwException(ths, "TypeError", "Target must be a file descriptor or a stream!");
+
+	// Closing an fd removes it from epoll, so EBADF only means we're late
+	if (fd >= 0 && epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT)
+		return throwException(ths, errno);
+
+	if (id >= 0) _unwatch(ths, loop, id);
+	return ths.newUndefined();
+}
+
+static Value loop_runOnce(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	int timeout = arg.get("length").to<int>() > 0 ? arg[0].to<int>() : -1;
+	return _dispatch(ths, loop, timeout);
+}
+
+static Value loop_run(Value& fnc, Value& ths, Value& arg) {
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	// Run until stop() is called or nothing is left to wait for
+	loop->stop = false;
+	while (!loop->stop && !loop->watches.empty()) {
+		Value rslt = _dispatch(ths, loop, -1);
+		if (rslt.isException()) return rslt;
+	}
+	return ths.newUndefined();
+}
+
+static Value loop_stop(Value& fnc, Value& ths, Value& arg) {
+	Loop* loop = ths.getPrivate<Loop*>(PRIV_EVENT_LOOP);
+	if (!loop) return throwException(ths, EBADF);
+
+	loop->stop = true;
+	return ths.newUndefined();
+}
+
+static Value event_Loop(Value& fnc, Value& ths, Value& arg) {
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) return throwException(ths, errno);
+
+	Loop* loop = new Loop;
+	loop->epfd = epfd;
+	loop->stop = false;
+	loop->next = 0;
+
+	Value obj = fnc.newObject();
+	if (obj.isException()) {
+		loop_free(loop);
+		return obj;
+	}
+
+	// Methods live on Loop.prototype; the instance only carries its state
+	obj.setPrivate(PRIV_EVENT_LOOP, loop, (FreeFunction) loop_free);
+	obj.set("__proto__", fnc.get("prototype"));
+	obj.set("handlers",  obj.newObject(), Value::PropAttrProtected);
+	return obj;
+}
+
+#define OK(x) ok = (!x.isException()) || ok
+#define NCONST(macro) OK(mod.setRecursive("exports." # macro, (long) macro))
+
+extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
+	Value mod(module, false);
+	bool ok = false;
+
+	// Objects
+	OK(mod.setRecursive("exports.Loop",                   event_Loop));
+	OK(mod.setRecursive("exports.Loop.prototype.add",     loop_add));
+	OK(mod.setRecursive("exports.Loop.prototype.modify",  loop_modify));
+	OK(mod.setRecursive("exports.Loop.prototype.remove",  loop_remove));
+	OK(mod.setRecursive("exports.Loop.prototype.run",     loop_run));
+	OK(mod.setRecursive("exports.Loop.prototype.runOnce", loop_runOnce));
+	OK(mod.setRecursive("exports.Loop.prototype.stop",    loop_stop));
+
+	// Constants
+#ifdef EPOLLIN
+	NCONST(EPOLLIN);
+#endif
+#ifdef EPOLLOUT
+	NCONST(EPOLLOUT);
+#endif
+#ifdef EPOLLPRI
+	NCONST(EPOLLPRI);
+#endif
+#ifdef EPOLLERR
+	NCONST(EPOLLERR);
+#endif
+#ifdef EPOLLHUP
+	NCONST(EPOLLHUP);
+#endif
+#ifdef EPOLLRDHUP
+	NCONST(EPOLLRDHUP);
+#endif
+#ifdef EPOLLET
+	NCONST(EPOLLET);
+#endif
+#ifdef EPOLLONESHOT
+	NCONST(EPOLLONESHOT);
+#endif
+
+	return ok;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2010 Nathaniel McCallum <nathaniel@natemccallum.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+#include <strings.h>
+#include <pthread.h>
+#include "hash.hpp"
+
+/*** CRC32C (Castagnoli) ***/
+
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t       crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init() {
+	for (uint32_t i=0 ; i < 256 ; i++) {
+		uint32_t crc = i;
+		for (int j=0 ; j < 8 ; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+
+	for (uint32_t i=0 ; i < 256 ; i++)
+		for (int j=1 ; j < 8 ; j++)
+			crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ crc32c_table[0][crc32c_table[j-1][i] & 0xFF];
+}
+
+// Slicing-by-8; processes eight bytes per step through eight tables
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+
+	for ( ; len >= 8 ; len -= 8, buf += 8) {
+		uint32_t lo = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24);
+		uint32_t hi = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t) buf[7] << 24;
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+		      crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+		      crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xFF];
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// The SSE4.2 crc32 instruction; selected at runtime by CPU support
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* buf, size_t len) {
+	uint64_t crc64 = crc;
+	for ( ; len >= 8 ; len -= 8, buf += 8) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	return crc;
+}
+#endif
+
+// Continues a CRC32C over data; start with a crc of 0
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+	const unsigned char* buf = (const unsigned char*) data;
+#if defined(__x86_64__) && defined(__GNUC__)
+	static const bool hw = __builtin_cpu_supports("sse4.2");
+	if (hw) return ~crc32c_hw(~crc, buf, len);
+#endif
+	return ~crc32c_sw(~crc, buf, len);
+}
+
+/*** xxHash64 ***/
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t xxh_read64(const unsigned char* buf) {
+	uint64_t val;
+	memcpy(&val, buf, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap64(val);
+#endif
+	return val;
+}
+
+static inline uint32_t xxh_read32(const unsigned char* buf) {
+	uint32_t val;
+	memcpy(&val, buf, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap32(val);
+#endif
+	return val;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME2;
+	acc  = ROTL64(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// Consumes whole 32 byte stripes; the four lanes are independent, so the
+// compiler can keep them in flight together
+static const unsigned char* xxh_stripes(uint64_t* v, const unsigned char* buf, size_t len) {
+	uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+	for ( ; len >= 32 ; len -= 32, buf += 32) {
+		v1 = xxh_round(v1, xxh_read64(buf));
+		v2 = xxh_round(v2, xxh_read64(buf + 8));
+		v3 = xxh_round(v3, xxh_read64(buf + 16));
+		v4 = xxh_round(v4, xxh_read64(buf + 24));
+	}
+	v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+	return buf;
+}
+
+static uint64_t xxh_final(HashState* state) {
+	const unsigned char* buf = state->buf;
+	size_t               len = state->buflen;
+	uint64_t             h;
+
+	if (state->total >= 32) {
+		uint64_t* v = state->xxh;
+		h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) + ROTL64(v[3], 18);
+		h = xxh_merge(h, v[0]);
+		h = xxh_merge(h, v[1]);
+		h = xxh_merge(h, v[2]);
+		h = xxh_merge(h, v[3]);
+	} else
+		h = state->xxh[2] + XXH_PRIME5; // v3 is the seed
+
+	h += state->total;
+	for ( ; len >= 8 ; len -= 8, buf += 8) {
+		h ^= xxh_round(0, xxh_read64(buf));
+		h  = ROTL64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t) xxh_read32(buf) * XXH_PRIME1;
+		h  = ROTL64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		buf += 4;
+		len -= 4;
+	}
+	while (len--) {
+		h ^= *buf++ * XXH_PRIME5;
+		h  = ROTL64(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*** SHA-256 ***/
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void sha256_blocks(uint32_t* h, const unsigned char* buf, size_t blocks) {
+	for ( ; blocks > 0 ; blocks--, buf += 64) {
+		uint32_t w[64];
+		for (int i=0 ; i < 16 ; i++)
+			w[i] = (uint32_t) buf[i*4] << 24 | buf[i*4+1] << 16 | buf[i*4+2] << 8 | buf[i*4+3];
+		for (int i=16 ; i < 64 ; i++) {
+			uint32_t s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19)  ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+		for (int i=0 ; i < 64 ; i++) {
+			uint32_t t1 = k + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			k = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+	}
+}
+
+/*** Generic interface ***/
+
+HashAlgorithm hash_lookup(const char* name) {
+	if (!strcasecmp(name, "crc32c"))   return HASH_CRC32C;
+	if (!strcasecmp(name, "xxhash64")) return HASH_XXHASH64;
+	if (!strcasecmp(name, "sha256"))   return HASH_SHA256;
+	return HASH_NONE;
+}
+
+size_t hash_size(HashAlgorithm algorithm) {
+	switch (algorithm) {
+		case HASH_CRC32C:   return 4;
+		case HASH_XXHASH64: return 8;
+		case HASH_SHA256:   return 32;
+		default:            return 0;
+	}
+}
+
+void hash_init(HashState* state, HashAlgorithm algorithm) {
+	static const uint32_t sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset(state, 0, sizeof(HashState));
+	state->algorithm = algorithm;
+	switch (algorithm) {
+		case HASH_XXHASH64: // Seed of 0
+			state->xxh[0] = XXH_PRIME1 + XXH_PRIME2;
+			state->xxh[1] = XXH_PRIME2;
+			state->xxh[2] = 0;
+			state->xxh[3] = 0 - XXH_PRIME1;
+			break;
+		case HASH_SHA256:
+			memcpy(state->sha, sha256_iv, sizeof(sha256_iv));
+			break;
+		default:
+			break;
+	}
+}
+
+void hash_update(HashState* state, const void* data, size_t len) {
+	const unsigned char* buf = (const unsigned char*) data;
+	size_t block = state->algorithm == HASH_XXHASH64 ? 32 : 64;
+
+	state->total += len;
+	if (state->algorithm == HASH_CRC32C) {
+		state->crc = crc32c(state->crc, buf, len);
+		return;
+	}
+
+	// Top up a partial block first
+	if (state->buflen > 0) {
+		size_t n = block - state->buflen < len ? block - state->buflen : len;
+		memcpy(state->buf + state->buflen, buf, n);
+		state->buflen += n;
+		buf += n;
+		len -= n;
+		if (state->buflen < block) return;
+
+		if (state->algorithm == HASH_XXHASH64)
+			xxh_stripes(state->xxh, state->buf, block);
+		else
+			sha256_blocks(state->sha, state->buf, 1);
+		state->buflen = 0;
+	}
+
+	// Then hash whole blocks straight from the input
+	size_t whole = len - len % block;
+	if (state->algorithm == HASH_XXHASH64)
+		xxh_stripes(state->xxh, buf, whole);
+	else
+		sha256_blocks(state->sha, buf, whole / block);
+
+	memcpy(state->buf, buf + whole, len - whole);
+	state->buflen = len - whole;
+}
+
+// Writes hash_size() bytes of digest, big endian for the integer hashes
+void hash_final(HashState* state, unsigned char* digest) {
+	switch (state->algorithm) {
+		case HASH_CRC32C:
+			for (int i=0 ; i < 4 ; i++)
+				digest[i] = state->crc >> (24 - i * 8);
+			break;
+
+		case HASH_XXHASH64: {
+			uint64_t h = xxh_final(state);
+			for (int i=0 ; i < 8 ; i++)
+				digest[i] = h >> (56 - i * 8);
+			break;
+		}
+
+		case HASH_SHA256: {
+			uint64_t bits = state->total * 8;
+			unsigned char pad[72] = { 0x80 };
+			size_t padlen = (state->buflen < 56 ? 56 : 120) - state->buflen;
+			for (int i=0 ; i < 8 ; i++)
+				pad[padlen + i] = bits >> (56 - i * 8);
+
+			uint64_t total = state->total;
+			hash_update(state, pad, padlen + 8);
+			state->total = total;
+
+			for (int i=0 ; i < 8 ; i++)
+				for (int j=0 ; j < 4 ; j++)
+					digest[i*4+j] = state->sha[i] >> (24 - j * 8);
+			break;
+		}
+
+		default:
+			break;
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2010 Nathaniel McCallum <nathaniel@natemccallum.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef HASH_HPP_
+#define HASH_HPP_
+#include <cstddef>
+#include <stdint.h>
+
+enum HashAlgorithm {
+	HASH_NONE,
+	HASH_CRC32C,
+	HASH_XXHASH64,
+	HASH_SHA256
+};
+
+struct HashState {
+	HashAlgorithm algorithm;
+	uint64_t      total;     // Bytes hashed so far
+	unsigned char buf[64];   // Partial block
+	size_t        buflen;
+	union {
+		uint32_t  crc;
+		uint64_t  xxh[4];
+		uint32_t  sha[8];
+	};
+};
+
+HashAlgorithm hash_lookup(const char* name);
+size_t        hash_size(HashAlgorithm algorithm);
+void          hash_init(HashState* state, HashAlgorithm algorithm);
+void          hash_update(HashState* state, const void* data, size_t len);
+void          hash_final(HashState* state, unsigned char* digest);
+uint32_t      crc32c(uint32_t crc, const void* data, size_t len);
+
+#endif /* HASH_HPP_ */
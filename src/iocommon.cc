@@ -22,80 +22,420 @@
  */
 
 #include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include "iocommon.hpp"
+#include "bincommon.hpp"
+
+static Stream* streams = NULL;
+
+static void stream_flush_all(bool lineonly) {
+	for (Stream* stream=streams ; stream ; stream=stream->next)
+		if (!lineonly || stream->wmode == STREAM_LINE_BUFFERED)
+			stream_flush(stream);
+}
+
+static void stream_flush_atexit() {
+	stream_flush_all(false);
+}
+
+static void stream_free(Stream* stream) {
+	stream_flush(stream);
+	if (stream->prev) stream->prev->next = stream->next;
+	else              streams            = stream->next;
+	if (stream->next) stream->next->prev = stream->prev;
+
+	free(stream->rbuf);
+	delete[] stream->wbuf;
+	delete stream;
+}
+
+Stream* stream_get(const Value& obj) {
+	return obj.getPrivate<Stream*>(PRIV_POSIX_STREAM);
+}
+
+static ssize_t _read(int fd, void* buf, size_t len) {
+	ssize_t rcvd;
+	do {
+		rcvd = read(fd, buf, len);
+	} while (rcvd < 0 && errno == EINTR);
+	return rcvd;
+}
+
+// Writes out all the vectors, returning the number of bytes written. If
+// an error occurs after some bytes were written the short count is returned.
+static ssize_t _writev(int fd, struct iovec* iov, int cnt) {
+	ssize_t total = 0;
+	while (cnt > 0) {
+		ssize_t snt = writev(fd, iov, cnt);
+		if (snt < 0) {
+			if (errno == EINTR) continue;
+			return total > 0 ? total : -1;
+		}
+		total += snt;
+
+		// Skip past the vectors that were completely written
+		for (; cnt > 0 && (size_t) snt >= iov->iov_len ; iov++, cnt--)
+			snt -= iov->iov_len;
+		if (cnt > 0) {
+			iov->iov_base  = (char*) iov->iov_base + snt;
+			iov->iov_len  -= snt;
+		}
+	}
+	return total;
+}
+
+// Reads more data onto the end of the buffer, keeping any unconsumed bytes
+static ssize_t stream_more(Stream* stream) {
+	if (stream->rpos > 0) {
+		memmove(stream->rbuf, stream->rbuf + stream->rpos, stream->rlen - stream->rpos);
+		stream->rlen -= stream->rpos;
+		stream->rpos  = 0;
+	}
+
+	if (stream->rlen == stream->rsize) {
+		size_t size = stream->rsize > 0 ? stream->rsize * 2 : STREAM_BUFFER_SIZE;
+		char*  tmp  = (char*) realloc(stream->rbuf, size);
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		stream->rbuf  = tmp;
+		stream->rsize = size;
+	}
+
+	// Like stdio, make sure prompts are visible before we block on input
+	stream_flush_all(true);
+
+	ssize_t rcvd = _read(stream->fd, stream->rbuf + stream->rlen, stream->rsize - stream->rlen);
+	if (rcvd > 0) stream->rlen += rcvd;
+	return rcvd;
+}
+
+ssize_t stream_read(Stream* stream, void* buf, size_t len) {
+	if (stream->fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (len == 0) return 0;
+
+	// Only readLine() needs lookahead; once its leftovers are drained,
+	// read straight into the caller's buffer instead of copying through ours
+	if (stream->rpos == stream->rlen) {
+		stream_flush_all(true);
+		return _read(stream->fd, buf, len);
+	}
+
+	size_t n = std::min(len, stream->rlen - stream->rpos);
+	memcpy(buf, stream->rbuf + stream->rpos, n);
+	stream->rpos += n;
+	return n;
+}
+
+int stream_flush(Stream* stream) {
+	if (stream->wlen == 0) return 0;
+	if (stream->fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	struct iovec iov = { stream->wbuf, stream->wlen };
+	ssize_t snt = _writev(stream->fd, &iov, 1);
+	if (snt < 0) return -1;
+
+	// Keep whatever couldn't be written for the next flush
+	stream->wlen -= snt;
+	memmove(stream->wbuf, stream->wbuf + snt, stream->wlen);
+	return stream->wlen > 0 ? -1 : 0;
+}
+
+ssize_t stream_write(Stream* stream, const char* buf, size_t len, bool newline) {
+	size_t total = len + (newline ? 1 : 0);
+	if (stream->fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// Copy into the write buffer if there is room
+	if (stream->wmode != STREAM_UNBUFFERED && stream->wlen + total <= stream->wsize) {
+		if (!stream->wbuf)
+			stream->wbuf = new char[stream->wsize];
+		memcpy(stream->wbuf + stream->wlen, buf, len);
+		stream->wlen += len;
+		if (newline)
+			stream->wbuf[stream->wlen++] = '\n';
+
+		// The bytes are ours now; if the flush fails they stay pending
+		if (stream->wmode == STREAM_LINE_BUFFERED && (newline || memchr(buf, '\n', len)))
+			stream_flush(stream);
+		return total;
+	}
+
+	// Otherwise, send the pending bytes, the data and the newline in one call
+	struct iovec iov[3] = {
+		{ stream->wbuf, stream->wlen      },
+		{ (void*) buf,  len               },
+		{ (void*) "\n", newline ? 1u : 0u },
+	};
+	ssize_t snt = _writev(stream->fd, iov, 3);
+	if (snt < 0) return -1;
+
+	if ((size_t) snt < stream->wlen) {
+		stream->wlen -= snt;
+		memmove(stream->wbuf, stream->wbuf + snt, stream->wlen);
+		return 0;
+	}
+	snt -= stream->wlen;
+	stream->wlen = 0;
+	return snt;
+}
+
+// Returns 1 if a line was read, 0 on EOF and -1 on error. A partial line
+// stays in the buffer, so nothing is lost if a non-blocking read fails.
+static int stream_readline(Stream* stream, UTF8& line) {
+	size_t scanned = 0;
+	for (;;) {
+		const char* start = stream->rbuf + stream->rpos;
+		size_t      avail = stream->rlen - stream->rpos;
+		const char* nl    = avail > scanned ? (const char*) memchr(start + scanned, '\n', avail - scanned) : NULL;
+		if (nl) {
+			line.assign(start, nl - start);
+			stream->rpos += nl - start + 1;
+			return 1;
+		}
+		scanned = avail;
+
+		ssize_t rcvd = stream_more(stream);
+		if (rcvd < 0) return -1;
+		if (rcvd == 0) {
+			if (stream->rpos == stream->rlen) return 0;
+			line.assign(stream->rbuf + stream->rpos, stream->rlen - stream->rpos);
+			stream->rpos = stream->rlen;
+			return 1;
+		}
+	}
+}
 
 static Value fd_close(Value& fnc, Value& ths, Value& arg) {
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	int status = stream_flush(stream);
+	int error  = errno;
+	int fd     = stream->fd;
+	stream->rpos = stream->rlen = stream->wlen = 0;
+	stream->fd   = -1; // The descriptor may be reused, so never touch it again
+	ths.setPrivate(PRIV_POSIX_FD, (void*) (size_t) -1);
 	if (close(fd) < 0)
 		return throwException(ths, errno);
+	if (status < 0)
+		return throwException(ths, error);
 	return ths.newUndefined();
 }
 
 static Value fd_flush(Value& fnc, Value& ths, Value& arg) {
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
-	if (fsync(fd) < 0)
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	if (stream_flush(stream) < 0) {
+		if (IO_WOULDBLOCK(errno)) return ths.newBoolean(false);
+		return throwException(ths, errno);
+	}
+	return ths.newBoolean(true);
+}
+
+static Value fd_setNonBlocking(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|b");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	bool enable = arg.get("length").to<int>() > 0 ? arg[0].to<bool>() : true;
+	int  flags  = fcntl(stream->fd, F_GETFL);
+	if (flags < 0) return throwException(ths, errno);
+	flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if (fcntl(stream->fd, F_SETFL, flags) < 0)
 		return throwException(ths, errno);
 	return ths.newUndefined();
 }
 
+static Value fd_sync(Value& fnc, Value& ths, Value& arg) {
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	if (stream_flush(stream) < 0 || fsync(stream->fd) < 0)
+		return throwException(ths, errno);
+	return ths.newUndefined();
+}
+
+static Value fd_setBuffering(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "s|n");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	StreamBuffering wmode;
+	UTF8 mode = arg[0].to<UTF8>();
+	if (mode == "none")
+		wmode = STREAM_UNBUFFERED;
+	else if (mode == "line")
+		wmode = STREAM_LINE_BUFFERED;
+	else if (mode == "full")
+		wmode = STREAM_FULLY_BUFFERED;
+	else
+		return throwException(ths, "ValueError", "Buffering mode must be one of 'none', 'line' or 'full'!");
+
+	long size = arg.get("length").to<int>() > 1 ? arg[1].to<long>() : STREAM_BUFFER_SIZE;
+	if (size <= 0)
+		return throwException(ths, "RangeError", "Buffer size must be greater than zero!");
+
+	if (stream_flush(stream) < 0)
+		return throwException(ths, errno);
+	if ((size_t) size != stream->wsize) {
+		delete[] stream->wbuf;
+		stream->wbuf  = NULL;
+		stream->wsize = size;
+	}
+	stream->wmode = wmode;
+	return ths.newUndefined();
+}
+
 static Value fd_read(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|n");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	int bs = arg.get("length").to<int>() > 0 ? arg[0].to<int>() : 1024;
+	UTF8 ret(bs > 0 ? bs : 0, '\0');
+	ssize_t rcvd = stream_read(stream, &ret[0], ret.length());
+	if (rcvd < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	ret.resize(rcvd);
+	return ths.newString(ret);
+}
+
+static Value fd_readBytes(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
 
 	int bs = arg.get("length").to<int>() > 0 ? arg[0].to<int>() : 1024;
-	char *buff = new char[bs];
-	ssize_t rcvd = read(fd, buff, bs);
+	unsigned char* buf = alloc_buffer(bs > 0 ? bs : 0);
+	ssize_t rcvd = stream_read(stream, buf, bs > 0 ? bs : 0);
 	if (rcvd < 0) {
-		delete[] buff;
-		return throwException(ths, errno);
+		free_buffer(buf);
+		return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
 	}
-	UTF8 ret = UTF8(buff, rcvd);
-	delete[] buff;
-	return ths.newString(ret);
+	return binary_new(ths, BINARY_STRING, buf, rcvd);
 }
 
-static UTF8 _readline(int fd) {
-	char c = '\0';
+static Value fd_readInto(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|nn");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
 
-	if (read(fd, &c, 1) == 0 || c == '\n')
-		return "";
+	unsigned char* buf;
+	size_t         len;
+	Value rslt = binary_range(arg, 0, true, &buf, &len);
+	if (rslt.isException()) return rslt;
 
-	return UTF8(&c, 1) + _readline(fd);
+	ssize_t rcvd = stream_read(stream, buf, len);
+	if (rcvd < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return ths.newNumber(rcvd);
 }
 
 static Value fd_readLine(Value& fnc, Value& ths, Value& arg) {
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
-	return ths.newString(_readline(fd));
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	UTF8 line;
+	if (stream_readline(stream, line) < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return ths.newString(line);
+}
+
+static Value fd_readLines(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	// With no argument, read until EOF
+	long max = arg.get("length").to<int>() > 0 ? arg[0].to<long>() : -1;
+
+	UTF8  line;
+	Value lines = ths.newArray();
+	for (long i=0 ; max < 0 || i < max ; i++) {
+		int status = stream_readline(stream, line);
+		if (status < 0 && IO_WOULDBLOCK(errno)) break;
+		if (status < 0)  return throwException(ths, errno);
+		if (status == 0) break;
+		arrayBuilder(lines, line);
+	}
+	return lines;
 }
 
 static Value fd_write(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
 	UTF8 buff = arg[0].to<UTF8>();
-	ssize_t snt = write(fd, buff.c_str(), buff.length());
-	if (snt < 0) return throwException(ths, errno);
+	ssize_t snt = stream_write(stream, buff.data(), buff.length());
+	if (snt < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
 	return ths.newNumber(snt);
 }
 
 static Value fd_writeLine(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
 	UTF8 buff = arg[0].to<UTF8>();
-	buff += "\n";
-	ssize_t snt = write(fd, buff.c_str(), buff.length());
-	if (snt < 0) return throwException(ths, errno);
+	ssize_t snt = stream_write(stream, buff.data(), buff.length(), true);
+	if (snt < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
 	return ths.newNumber(snt);
 }
 
-void stream_from_fd(Value& obj, int fd) {
+void stream_from_fd(Value& obj, int fd, StreamBuffering wmode) {
+	static bool registered = false;
+	if (!registered)
+		registered = atexit(stream_flush_atexit) == 0;
+
+	Stream* stream = new Stream;
+	memset(stream, 0, sizeof(Stream));
+	stream->fd    = fd;
+	stream->wmode = wmode;
+	stream->wsize = STREAM_BUFFER_SIZE;
+	stream->next  = streams;
+	if (streams) streams->prev = stream;
+	streams = stream;
+
 	obj.setPrivate(PRIV_POSIX_FD, (void*) (size_t) fd);
-	obj.set("close",         fd_close);
-	obj.set("flush",         fd_flush);
-	obj.set("read",          fd_read);
-	obj.set("readLine",      fd_readLine);
-	obj.set("write",         fd_write);
-	obj.set("writeLine",     fd_writeLine);
+	obj.setPrivate(PRIV_POSIX_STREAM, stream, (FreeFunction) stream_free);
+}
+
+// Installs the stream methods on an object shared by all streams of a kind
+bool stream_prototype(Value& proto) {
+	bool ok = false;
+	ok = !proto.set("close",          fd_close).isException()          || ok;
+	ok = !proto.set("flush",          fd_flush).isException()          || ok;
+	ok = !proto.set("read",           fd_read).isException()           || ok;
+	ok = !proto.set("readBytes",      fd_readBytes).isException()      || ok;
+	ok = !proto.set("readInto",       fd_readInto).isException()       || ok;
+	ok = !proto.set("readLine",       fd_readLine).isException()       || ok;
+	ok = !proto.set("readLines",      fd_readLines).isException()      || ok;
+	ok = !proto.set("setBuffering",   fd_setBuffering).isException()   || ok;
+	ok = !proto.set("setNonBlocking", fd_setNonBlocking).isException() || ok;
+	ok = !proto.set("sync",           fd_sync).isException()           || ok;
+	ok = !proto.set("write",          fd_write).isException()          || ok;
+	ok = !proto.set("writeLine",      fd_writeLine).isException()      || ok;
+	return ok;
 }
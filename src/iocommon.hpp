@@ -27,8 +27,39 @@
 #include <natus/natus.hpp>
 using namespace natus;
 
-#define PRIV_POSIX_FD "posix::fd"
+#define PRIV_POSIX_FD     "posix::fd"
+#define PRIV_POSIX_STREAM "posix::stream"
 
-void stream_from_fd(Value& obj, int fd);
+#define STREAM_BUFFER_SIZE 65536
+
+// True if errno indicates a non-blocking fd has nothing to offer right now
+#define IO_WOULDBLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+enum StreamBuffering {
+	STREAM_UNBUFFERED,     // Every write goes straight to the fd
+	STREAM_LINE_BUFFERED,  // Flushed whenever a newline is written
+	STREAM_FULLY_BUFFERED  // Flushed only when full or on flush()/close()
+};
+
+struct Stream {
+	int     fd;
+	char*   rbuf;   // Read buffer, allocated on first read
+	size_t  rpos;   // Offset of the first unconsumed byte
+	size_t  rlen;   // Offset one past the last buffered byte
+	size_t  rsize;  // Capacity of the read buffer (grows to fit long lines)
+	char*   wbuf;   // Write buffer, allocated on first buffered write
+	size_t  wlen;   // Number of bytes waiting to be written
+	size_t  wsize;  // Capacity of the write buffer
+	StreamBuffering wmode;
+	Stream* prev;   // Live streams are kept in a list so they can be
+	Stream* next;   // flushed at exit
+};
+
+Stream* stream_get(const Value& obj);
+ssize_t stream_read(Stream* stream, void* buf, size_t len);
+ssize_t stream_write(Stream* stream, const char* buf, size_t len, bool newline=false);
+int     stream_flush(Stream* stream);
+void    stream_from_fd(Value& obj, int fd, StreamBuffering wmode=STREAM_UNBUFFERED);
+bool    stream_prototype(Value& proto);
 
 #endif /* IOCOMMON_HPP_ */
@@ -3,9 +3,11 @@
 #include <cstring>
 #include <cstdio>
 #include <climits>
+#include <algorithm>
 #include <sysexits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/statvfs.h>
 #include <sys/times.h>
 #include <sys/utsname.h>
@@ -25,9 +27,17 @@
 
 using namespace std;
 
-#define I_ACKNOWLEDGE_THAT_NATUS_IS_NOT_STABLE
-#include <natus/natus.hpp>
-using namespace natus;
+#include "bincommon.hpp"
+
+struct Mapping {
+	void*  addr;
+	size_t len;
+};
+
+static void mapping_free(Mapping* map) {
+	munmap(map->addr, map->len);
+	delete map;
+}
 
 #define doexc() ths.newString(strerror(errno)).toException()
 #define doval(code, val) (code == 0 ? val : doexc())
@@ -488,6 +498,16 @@ static Value posix_minor(Value& fnc, Value& ths, Value& arg) {
 	return ths.newNumber(minor(arg[0].to<int>()));
 }
 
+static Value posix_memadvise(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "on");
+
+	// Growing a mapped ByteArray moves it to the heap and unmaps the
+	// memory, so only trust the mapping its current storage belongs to
+	Mapping* map = (Mapping*) binary_owner(arg[0], (FreeFunction) mapping_free);
+	if (!map) return ths.newString("Argument must be a mapped ByteString or ByteArray!").toException();
+	doerr(madvise(map->addr, map->len, arg[1].to<int>()));
+}
+
 static Value posix_mkdir(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 	NATUS_CHECK_ORIGIN(ths, ("file://" + arg[0].to<UTF8>()).c_str());
@@ -533,6 +553,45 @@ static Value posix_mknod(Value& fnc, Value& ths, Value& arg) {
 	doerr(mknod(arg[0].to<UTF8>().c_str(), mode, dev));
 }
 
+// Maps a file into memory as a ByteString (or a ByteArray if PROT_WRITE is set)
+static Value posix_mmap(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nn|nnn");
+
+	size_t len    = arg[1].to<size_t>();
+	int    prot   = PROT_READ;
+	int    flags  = MAP_SHARED;
+	off_t  offset = 0;
+	if (arg.get("length").to<int>() > 2) {
+		prot = arg[2].to<int>();
+		if (arg.get("length").to<int>() > 3) {
+			flags = arg[3].to<int>();
+			if (arg.get("length").to<int>() > 4)
+				offset = (off_t) arg[4].to<double>();
+		}
+	}
+
+	void* addr = mmap(NULL, len, prot, flags, arg[0].to<int>(), offset);
+	if (addr == MAP_FAILED) return doexc();
+
+	Mapping* map = new Mapping;
+	map->addr = addr;
+	map->len  = len;
+
+	// The mapping is released along with the last object sharing its memory
+	Value obj = binary_new(ths, prot & PROT_WRITE ? BINARY_ARRAY : BINARY_STRING, (unsigned char*) addr, len, (FreeFunction) mapping_free, map);
+	return obj;
+}
+
+static Value posix_msync(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|n");
+
+	// Growing a mapped ByteArray moves it to the heap and unmaps the
+	// memory, so only trust the mapping its current storage belongs to
+	Mapping* map = (Mapping*) binary_owner(arg[0], (FreeFunction) mapping_free);
+	if (!map) return ths.newString("Argument must be a mapped ByteString or ByteArray!").toException();
+	doerr(msync(map->addr, map->len, arg.get("length").to<int>() > 1 ? arg[1].to<int>() : MS_SYNC));
+}
+
 static Value posix_nice(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "n");
 
@@ -591,14 +650,51 @@ static Value posix_pipe(Value& fnc, Value& ths, Value& arg) {
 static Value posix_read(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "nn");
 
-	char* buffer = new char[arg[1].to<int>()];
-	if (read(arg[0].to<int>(), buffer, arg[1].to<int>()) < 0)
-		return doexc();
-	string str = buffer;
-	delete[] buffer;
+	string str(max(arg[1].to<int>(), 0), '\0');
+	ssize_t rd = read(arg[0].to<int>(), &str[0], str.length());
+	if (rd < 0) return doexc();
+	str.resize(rd);
 	return ths.newString(str);
 }
 
+static Value posix_readBytes(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nn");
+
+	size_t len = max(arg[1].to<int>(), 0);
+	unsigned char* buffer = alloc_buffer(len);
+	ssize_t rd = read(arg[0].to<int>(), buffer, len);
+	if (rd < 0) {
+		free_buffer(buffer);
+		return doexc();
+	}
+	return binary_new(ths, BINARY_STRING, buffer, rd);
+}
+
+static Value posix_readInto(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "no|nn");
+
+	unsigned char* buffer;
+	size_t         len;
+	Value rslt = binary_range(arg, 1, true, &buffer, &len);
+	if (rslt.isException()) return rslt;
+
+	ssize_t rd = read(arg[0].to<int>(), buffer, len);
+	if (rd < 0) return doexc();
+	return ths.newNumber(rd);
+}
+
+static Value posix_readv(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "na");
+
+	vector<struct iovec> iov;
+	Value rslt = binary_iovec(arg[1], true, iov);
+	if (rslt.isException()) return rslt;
+
+	ssize_t rd = readv(arg[0].to<int>(), iov.empty() ? NULL : &iov[0], iov.size());
+	if (rd < 0) return doexc();
+	return ths.newNumber(rd);
+}
+
 static Value posix_readlink(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 	NATUS_CHECK_ORIGIN(ths, ("file://" + arg[0].to<UTF8>()).c_str());
@@ -706,6 +802,22 @@ static Value posix_setuid(Value& fnc, Value& ths, Value& arg) {
 	doerr(setuid(arg[0].to<int>()));
 }
 
+#ifdef __linux__
+static Value posix_splice(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "n(nN)n(nN)n|n");
+
+	loff_t offin, offout;
+	offin  = arg[1].isNull() ? 0 : (loff_t) arg[1].to<double>();
+	offout = arg[3].isNull() ? 0 : (loff_t) arg[3].to<double>();
+
+	ssize_t size = splice(arg[0].to<int>(), arg[1].isNull() ? NULL : &offin,
+	                      arg[2].to<int>(), arg[3].isNull() ? NULL : &offout,
+	                      arg[4].to<size_t>(), arg.get("length").to<int>() > 5 ? arg[5].to<int>() : 0);
+	if (size < 0) return doexc();
+	return ths.newNumber(size);
+}
+#endif
+
 static Value posix_stat(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 	NATUS_CHECK_ORIGIN(ths, ("file://" + arg[0].to<UTF8>()).c_str());
@@ -803,6 +915,17 @@ static Value posix_tcsetpgrp(Value& fnc, Value& ths, Value& arg) {
 	doerr(tcsetpgrp(arg[0].to<int>(), arg[1].to<int>()));
 }
 
+#ifdef __linux__
+static Value posix_tee(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nnn|n");
+
+	ssize_t size = tee(arg[0].to<int>(), arg[1].to<int>(), arg[2].to<size_t>(),
+	                   arg.get("length").to<int>() > 3 ? arg[3].to<int>() : 0);
+	if (size < 0) return doexc();
+	return ths.newNumber(size);
+}
+#endif
+
 static Value posix_tempnam(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s|ss");
 
@@ -916,6 +1039,18 @@ static Value posix_write(Value& fnc, Value& ths, Value& arg) {
 	return ths.newNumber(size);
 }
 
+static Value posix_writev(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "na");
+
+	vector<struct iovec> iov;
+	Value rslt = binary_iovec(arg[1], false, iov);
+	if (rslt.isException()) return rslt;
+
+	ssize_t size = writev(arg[0].to<int>(), iov.empty() ? NULL : &iov[0], iov.size());
+	if (size < 0) return doexc();
+	return ths.newNumber(size);
+}
+
 #define OK(x) ok = (!x.isException()) || ok
 #define NCONST(macro) OK(base.setRecursive("exports." # macro, (long) macro))
 #define NFUNC(func) OK(base.setRecursive("exports." # func, posix_ ## func))
@@ -983,18 +1118,24 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 	NFUNC(link);
 	NFUNC(lseek);
 	NFUNC(lstat);
+	OK(base.setRecursive("exports.madvise", posix_memadvise)); // posix_madvise() is libc's
 	NFUNC(major);
 	NFUNC(makedev);
 	NFUNC(minor);
 	NFUNC(mkdir);
 	NFUNC(mkfifo);
 	NFUNC(mknod);
+	NFUNC(mmap);
+	NFUNC(msync);
 	NFUNC(nice);
 	NFUNC(open);
 	NFUNC(openpty);
 	NFUNC(pathconf);
 	NFUNC(pipe);
 	NFUNC(read);
+	NFUNC(readBytes);
+	NFUNC(readInto);
+	NFUNC(readv);
 	NFUNC(readlink);
 	NFUNC(rename);
 	NFUNC(rmdir);
@@ -1012,6 +1153,9 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 	NFUNC(setreuid);
 	NFUNC(setsid);
 	NFUNC(setuid);
+#ifdef __linux__
+	NFUNC(splice);
+#endif
 	NFUNC(stat);
 	NFUNC(statvfs);
 	NFUNC(strerror);
@@ -1020,6 +1164,9 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 	NFUNC(system);
 	NFUNC(tcgetpgrp);
 	NFUNC(tcsetpgrp);
+#ifdef __linux__
+	NFUNC(tee);
+#endif
 	NFUNC(tempnam);
 	NFUNC(times);
 	NFUNC(tmpnam);
@@ -1031,6 +1178,7 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 	NFUNC(wait);
 	NFUNC(waitpid);
 	NFUNC(write);
+	NFUNC(writev);
 
 	// Constants
 #ifdef EX_CANTCREAT
@@ -1084,6 +1232,48 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 #ifdef F_OK
 	NCONST(F_OK);
 #endif
+#ifdef MADV_DONTNEED
+	NCONST(MADV_DONTNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+	NCONST(MADV_HUGEPAGE);
+#endif
+#ifdef MADV_NORMAL
+	NCONST(MADV_NORMAL);
+#endif
+#ifdef MADV_RANDOM
+	NCONST(MADV_RANDOM);
+#endif
+#ifdef MADV_SEQUENTIAL
+	NCONST(MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+	NCONST(MADV_WILLNEED);
+#endif
+#ifdef MAP_ANONYMOUS
+	NCONST(MAP_ANONYMOUS);
+#endif
+#ifdef MAP_NORESERVE
+	NCONST(MAP_NORESERVE);
+#endif
+#ifdef MAP_POPULATE
+	NCONST(MAP_POPULATE);
+#endif
+#ifdef MAP_PRIVATE
+	NCONST(MAP_PRIVATE);
+#endif
+#ifdef MAP_SHARED
+	NCONST(MAP_SHARED);
+#endif
+#ifdef MS_ASYNC
+	NCONST(MS_ASYNC);
+#endif
+#ifdef MS_INVALIDATE
+	NCONST(MS_INVALIDATE);
+#endif
+#ifdef MS_SYNC
+	NCONST(MS_SYNC);
+#endif
 #ifdef NGROUPS_MAX
 	NCONST(NGROUPS_MAX);
 #endif
@@ -1144,9 +1334,33 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 #ifdef O_WRONLY
 	NCONST(O_WRONLY);
 #endif
+#ifdef PROT_EXEC
+	NCONST(PROT_EXEC);
+#endif
+#ifdef PROT_NONE
+	NCONST(PROT_NONE);
+#endif
+#ifdef PROT_READ
+	NCONST(PROT_READ);
+#endif
+#ifdef PROT_WRITE
+	NCONST(PROT_WRITE);
+#endif
 #ifdef R_OK
 	NCONST(R_OK);
 #endif
+#ifdef SPLICE_F_GIFT
+	NCONST(SPLICE_F_GIFT);
+#endif
+#ifdef SPLICE_F_MORE
+	NCONST(SPLICE_F_MORE);
+#endif
+#ifdef SPLICE_F_MOVE
+	NCONST(SPLICE_F_MOVE);
+#endif
+#ifdef SPLICE_F_NONBLOCK
+	NCONST(SPLICE_F_NONBLOCK);
+#endif
 #ifdef ST_APPEND
 	NCONST(ST_APPEND);
 #endif
@@ -1,21 +1,73 @@
 #include <cerrno>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/time.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #ifdef __linux__
 #include <asm-generic/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #endif
 using namespace std;
 
 #include "iocommon.hpp"
+#include "bincommon.hpp"
 
-#define PRIV_POSIX_FD "posix::fd"
+#define PRIV_POSIX_FD     "posix::fd"
+#define PRIV_SOCKET_INFO  "socket::info"
 
-static Value socket_from_sock(Value& ctx, int sock, int domain, int type, int protocol);
+#define SOCKET_ACCEPT_MAX 64
+
+struct SocketInfo {
+	int domain;
+	int type;
+	int protocol;
+};
+
+static void socket_info_free(SocketInfo* info) {
+	delete info;
+}
+
+static Value socket_from_sock(Value& ctx, const Value& proto, int sock, int domain, int type, int protocol);
+
+#ifdef __linux__
+#define _recvmmsg(fd, msgs, cnt, flags) recvmmsg(fd, msgs, cnt, (flags) | MSG_WAITFORONE, NULL)
+#define _sendmmsg(fd, msgs, cnt, flags) sendmmsg(fd, msgs, cnt, flags)
+#else
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int  msg_len;
+};
+
+static int _recvmmsg(int fd, struct mmsghdr* msgs, unsigned int cnt, int flags) {
+	unsigned int i;
+	for (i=0 ; i < cnt ; i++) {
+		// Like MSG_WAITFORONE, only the first receive may block
+		ssize_t rcvd = recvmsg(fd, &msgs[i].msg_hdr, i > 0 ? flags | MSG_DONTWAIT : flags);
+		if (rcvd < 0) return i > 0 ? (int) i : -1;
+		msgs[i].msg_len = rcvd;
+	}
+	return i;
+}
+
+static int _sendmmsg(int fd, struct mmsghdr* msgs, unsigned int cnt, int flags) {
+	unsigned int i;
+	for (i=0 ; i < cnt ; i++) {
+		ssize_t snt = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (snt < 0) return i > 0 ? (int) i : -1;
+		msgs[i].msg_len = snt;
+	}
+	return i;
+}
+#endif
 
 static Value throwExceptionEAI(const Value& ctx, int error) {
 	const char* type = "IOError";
@@ -40,6 +92,62 @@ static Value throwExceptionEAI(const Value& ctx, int error) {
 	return throwException(ctx, type, gai_strerror(error), error);
 }
 
+// Resolves a host/port pair for the socket's address family
+static Value _resolve(Value& ths, const Value& host, const Value& port, sockaddr_storage* addr, socklen_t* len) {
+	SocketInfo* info = ths.getPrivate<SocketInfo*>(PRIV_SOCKET_INFO);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = info ? info->domain : AF_UNSPEC;
+	hints.ai_socktype = info ? info->type   : 0;
+
+	struct addrinfo* ai = NULL;
+	int status = getaddrinfo(host.to<UTF8>().c_str(), port.to<UTF8>().c_str(), &hints, &ai);
+	if (status != 0)
+		return throwExceptionEAI(ths, status);
+
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	*len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return ths.newUndefined();
+}
+
+// Describes a received datagram as { length, address, port, truncated }
+static Value _datagram(Value& ths, size_t length, const struct msghdr& msg) {
+	char name[1024], port[21];
+
+	Value dgram = ths.newObject();
+	dgram.set("length", (double) length);
+	if (msg.msg_namelen > 0 && getnameinfo((sockaddr*) msg.msg_name, msg.msg_namelen, name, 1024, port, 21, NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+		dgram.set("address", UTF8(name));
+		dgram.set("port",    atoi(port));
+	}
+	dgram.set("truncated", (msg.msg_flags & MSG_TRUNC) != 0);
+	return dgram;
+}
+
+// Accepts a ByteString, a ByteArray or a string (stored in tmp) as outgoing data
+static bool _payload(const Value& data, UTF8& tmp, struct iovec* iov) {
+	if (binary_type(data) != BINARY_NONE) {
+		size_t len;
+		iov->iov_base = binary_buffer(data, &len);
+		iov->iov_len  = len;
+		return true;
+	}
+
+	if (!data.isString()) return false;
+	tmp = data.to<UTF8>();
+	iov->iov_base = (void*) tmp.data();
+	iov->iov_len  = tmp.length();
+	return true;
+}
+
+// Gets the socket's descriptor, or -1 once the socket has been closed
+static int socket_fd(const Value& obj) {
+	Stream* stream = stream_get(obj);
+	return stream ? stream->fd : -1;
+}
+
 class SocketClass : public Class {
 	virtual Class::Flags getFlags() {
 		return Class::FlagGet;
@@ -51,14 +159,42 @@ class SocketClass : public Class {
 		char name[1024], port[21];
 		int status = 0;
 
-		int fd = obj.getPrivate<long>(PRIV_POSIX_FD);
+		int  fd   = socket_fd(obj);
+		UTF8 prop = key.to<UTF8>();
+
+		SocketInfo* info = obj.getPrivate<SocketInfo*>(PRIV_SOCKET_INFO);
+		if (info && prop == "domain")   return obj.newNumber(info->domain);
+		if (info && prop == "type")     return obj.newNumber(info->type);
+		if (info && prop == "protocol") return obj.newNumber(info->protocol);
+
+		if (prop != "isConnected"   && prop != "isReadable"   && prop != "isWritable" &&
+		    prop != "remoteAddress" && prop != "remotePort"   &&
+		    prop != "localAddress"  && prop != "localPort")
+			return obj.newUndefined().toException(); // Don't intercept on other properties
+		if (fd < 0)
+			return throwException(obj, EBADF);
+
+		if (prop == "isConnected")
+			return obj.newBoolean(getpeername(fd, (sockaddr*) &addr, &len) == 0);
+
+		if (prop == "isReadable" || prop == "isWritable") {
+			bool rd = prop == "isReadable";
+
+			// Data buffered by readLine() can be read without touching the socket
+			Stream* stream = stream_get(obj);
+			if (rd && stream && stream->rpos < stream->rlen)
+				return obj.newBoolean(true);
 
-		if (key.to<UTF8>() == "remoteAddress" || key.to<UTF8>() == "remotePort")
+			struct pollfd pfd = { fd, (short) (rd ? POLLIN : POLLOUT), 0 };
+			if (poll(&pfd, 1, 0) < 0)
+				return throwException(obj, errno);
+			return obj.newBoolean(pfd.revents & (rd ? POLLIN | POLLHUP | POLLERR : POLLOUT | POLLERR));
+		}
+
+		if (prop == "remoteAddress" || prop == "remotePort")
 			status = getpeername(fd, (sockaddr*) &addr, &len);
-		else if (key.to<UTF8>() == "localAddress" || key.to<UTF8>() == "localPort")
-			status = getsockname(fd, (sockaddr*) &addr, &len);
 		else
-			return obj.newUndefined().toException(); // Don't intercept on other properties
+			status = getsockname(fd, (sockaddr*) &addr, &len);
 		if (status < 0)
 			return throwException(obj, errno);
 
@@ -66,26 +202,89 @@ class SocketClass : public Class {
 		if (status < 0)
 			return throwExceptionEAI(obj, status);
 
-		if (key.to<UTF8>().find("Address") != string::npos)
+		if (prop.find("Address") != string::npos)
 			return obj.newString(name);
 		return obj.newNumber(atoi(port));
 	}
 };
 
 static Value socket_accept(Value& fnc, Value& ths, Value& arg) {
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+	SocketInfo* info = ths.getPrivate<SocketInfo*>(PRIV_SOCKET_INFO);
+	if (!info) return throwException(ths, EBADF);
 
 	int newsock = accept(fd, NULL, NULL);
-	if (newsock < 0) return throwException(ths, errno);
-	return socket_from_sock(ths, newsock, ths.get("domain").to<int>(), ths.get("type").to<int>(), ths.get("protocol").to<int>());
+	if (newsock < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return socket_from_sock(ths, ths.get("__proto__"), newsock, info->domain, info->type, info->protocol);
+}
+
+static int _accept(int fd) {
+	int sock;
+	do {
+#ifdef __linux__
+		sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		sock = accept(fd, NULL, NULL);
+		if (sock >= 0) {
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+			fcntl(sock, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+	} while (sock < 0 && (errno == EINTR || errno == ECONNABORTED));
+	return sock;
+}
+
+// Drains up to max pending connections, returning them as non-blocking sockets
+static Value socket_acceptMany(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|n");
+
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+	SocketInfo* info = ths.getPrivate<SocketInfo*>(PRIV_SOCKET_INFO);
+	if (!info) return throwException(ths, EBADF);
+
+	long max = arg.get("length").to<int>() > 0 ? arg[0].to<long>() : SOCKET_ACCEPT_MAX;
+
+	// A blocking listener would block once the backlog is empty, so poll first
+	int  flags    = fcntl(fd, F_GETFL);
+	bool blocking = flags >= 0 && !(flags & O_NONBLOCK);
+
+	Value proto = ths.get("__proto__");
+	Value socks = ths.newArray();
+	for (long i=0 ; i < max ; i++) {
+		if (blocking && i > 0) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 0) <= 0) break;
+		}
+
+		int newsock = _accept(fd);
+		if (newsock < 0) {
+			// Report errors only if they keep us from returning anything
+			if (i > 0 || IO_WOULDBLOCK(errno)) break;
+			return throwException(ths, errno);
+		}
+
+		// Like accept errors, a failure is reported only if nothing was
+		// accepted, so the sockets we already have are never lost
+		Value sock = socket_from_sock(ths, proto, newsock, info->domain, info->type, info->protocol);
+		if (sock.isException()) {
+			close(newsock);
+			if (i > 0) break;
+			return sock;
+		}
+		arrayBuilder(socks, sock);
+	}
+	return socks;
 }
 
 static Value socket_bind(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|s(sn)");
 
-	int    fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int    fd = socket_fd(ths);
 	string ip = "0.0.0.0";
 	string port;
+	if (fd < 0) return throwException(ths, EBADF);
 
 	if (arg.get("length").to<int>() > 0) {
 		ip = arg[0].to<UTF8>();
@@ -110,7 +309,8 @@ static Value socket_bind(Value& fnc, Value& ths, Value& arg) {
 static Value socket_connect(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s(sn)");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
 
 	struct addrinfo* ai = NULL;
 	int status = getaddrinfo(arg[0].to<UTF8>().c_str(), arg[1].to<UTF8>().c_str(), NULL, &ai);
@@ -120,16 +320,20 @@ static Value socket_connect(Value& fnc, Value& ths, Value& arg) {
 	}
 	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
 		freeaddrinfo(ai);
+
+		// Non-blocking sockets finish connecting once they become writable
+		if (errno == EINPROGRESS) return ths.newBoolean(false);
 		return throwException(ths, errno);
 	}
 	freeaddrinfo(ai);
-	return ths.newUndefined();
+	return ths.newBoolean(true);
 }
 
 static Value socket_listen(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "n");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
 	if (listen(fd, arg.get("length").to<int>() > 0 ? arg[0].to<int>() : 1024) < 0)
 		return throwException(ths, errno);
 	return ths.newUndefined();
@@ -138,40 +342,593 @@ static Value socket_listen(Value& fnc, Value& ths, Value& arg) {
 static Value socket_receive(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|n");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
 
+	// Go through the stream so that bytes buffered by readLine() aren't lost
 	int bs = arg.get("length").to<int>() > 0 ? arg[0].to<int>() : 1024;
-	char *buff = new char[bs];
-	ssize_t rcvd = recv(fd, buff, bs, 0);
+	string ret(bs > 0 ? bs : 0, '\0');
+	ssize_t rcvd = stream_read(stream, &ret[0], ret.length());
+	if (rcvd < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	ret.resize(rcvd);
+	return ths.newString(ret);
+}
+
+static Value socket_recvInto(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "o|nnn");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	unsigned char* buf;
+	size_t         len;
+	Value rslt = binary_range(arg, 0, true, &buf, &len);
+	if (rslt.isException()) return rslt;
+
+	// Drain whatever readLine() has buffered before going to the socket
+	int flags = arg.get("length").to<int>() > 3 ? arg[3].to<int>() : 0;
+	ssize_t rcvd;
+	if (stream->rpos < stream->rlen || flags == 0)
+		rcvd = stream_read(stream, buf, len);
+	else
+		rcvd = recv(stream->fd, buf, len, flags);
+	if (rcvd < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return ths.newNumber(rcvd);
+}
+
+static Value socket_recvmsg(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "a|n");
+
+	Stream* stream = stream_get(ths);
+	if (!stream) return throwException(ths, EBADF);
+
+	vector<struct iovec> iov;
+	Value rslt = binary_iovec(arg[0], true, iov);
+	if (rslt.isException()) return rslt;
+
+	// Drain whatever readLine() has buffered before going to the socket
+	if (stream->rpos < stream->rlen) {
+		size_t total = 0;
+		for (size_t i=0 ; i < iov.size() && stream->rpos < stream->rlen ; i++)
+			total += stream_read(stream, iov[i].iov_base, iov[i].iov_len);
+		return ths.newNumber(total);
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov.empty() ? NULL : &iov[0];
+	msg.msg_iovlen = iov.size();
+
+	ssize_t rcvd = recvmsg(stream->fd, &msg, arg.get("length").to<int>() > 1 ? arg[1].to<int>() : 0);
+	if (rcvd < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+	return ths.newNumber(rcvd);
+}
+
+static Value socket_recvFrom(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "|(on)n");
+
+	int fd    = socket_fd(ths);
+	int argc  = arg.get("length").to<int>();
+	int flags = argc > 1 ? arg[1].to<int>() : 0;
+	if (fd < 0) return throwException(ths, EBADF);
+
+	// Either fill the caller's ByteArray or return the data as a new ByteString
+	bool           fresh = !(argc > 0 && arg[0].isObject());
+	unsigned char* buf;
+	size_t         len;
+	if (fresh) {
+		len = argc > 0 ? max(arg[0].to<int>(), 0) : 65536;
+		buf = alloc_buffer(len);
+	} else {
+		if (binary_type(arg[0]) != BINARY_ARRAY)
+			return throwException(ths, "TypeError", "Argument must be a ByteArray!");
+		buf = binary_mutable(arg[0], &len);
+	}
+
+	sockaddr_storage addr;
+	struct iovec  iov = { buf, len };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name    = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov     = &iov;
+	msg.msg_iovlen  = 1;
+
+	ssize_t rcvd = recvmsg(fd, &msg, flags);
 	if (rcvd < 0) {
-		delete[] buff;
-		return throwException(ths, errno);
+		if (fresh) free_buffer(buf);
+		return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
 	}
-	string ret = string(buff, rcvd);
-	delete[] buff;
-	return ths.newString(ret);
+
+	Value dgram = _datagram(ths, rcvd, msg);
+	if (fresh) dgram.set("data", binary_new(ths, BINARY_STRING, buf, rcvd));
+	return dgram;
+}
+
+// Receives up to one datagram per ByteArray in the pool with a single syscall
+static Value socket_recvMany(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "a|n");
+
+	int fd    = socket_fd(ths);
+	int flags = arg.get("length").to<int>() > 1 ? arg[1].to<int>() : 0;
+	if (fd < 0) return throwException(ths, EBADF);
+
+	vector<struct iovec> iov;
+	Value rslt = binary_iovec(arg[0], true, iov);
+	if (rslt.isException()) return rslt;
+	if (iov.empty()) return ths.newArray();
+
+	vector<sockaddr_storage> addrs(iov.size());
+	vector<struct mmsghdr>   msgs(iov.size());
+	memset(&msgs[0], 0, sizeof(struct mmsghdr) * msgs.size());
+	for (size_t i=0 ; i < msgs.size() ; i++) {
+		msgs[i].msg_hdr.msg_name    = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+		msgs[i].msg_hdr.msg_iov     = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	int n;
+	do {
+		n = _recvmmsg(fd, &msgs[0], msgs.size(), flags);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return IO_WOULDBLOCK(errno) ? ths.newNull() : throwException(ths, errno);
+
+	// Result i describes the datagram now stored in pool[i]
+	Value dgrams = ths.newArray();
+	for (int i=0 ; i < n ; i++)
+		arrayBuilder(dgrams, _datagram(ths, msgs[i].msg_len, msgs[i].msg_hdr));
+	return dgrams;
 }
 
 static Value socket_send(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "s");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+
+	// Anything queued by a buffered write() must go out first
+	Stream* stream = stream_get(ths);
+	if (stream && stream_flush(stream) < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
 
 	string buff = arg[0].to<UTF8>();
 	ssize_t snt = send(fd, buff.c_str(), buff.length(), 0);
-	if (snt < 0) return throwException(ths, errno);
+	if (snt < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
 	return ths.newNumber(snt);
 }
 
+static Value socket_sendTo(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(so)s(sn)|n");
+
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+
+	UTF8 tmp;
+	struct iovec iov;
+	if (!_payload(arg[0], tmp, &iov))
+		return throwException(ths, "TypeError", "Data must be a string, ByteString or ByteArray!");
+
+	sockaddr_storage addr;
+	socklen_t        len;
+	Value rslt = _resolve(ths, arg[1], arg[2], &addr, &len);
+	if (rslt.isException()) return rslt;
+
+	int flags = arg.get("length").to<int>() > 3 ? arg[3].to<int>() : 0;
+	ssize_t snt = sendto(fd, iov.iov_base, iov.iov_len, flags, (sockaddr*) &addr, len);
+	if (snt < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
+	return ths.newNumber(snt);
+}
+
+// Sends a batch of datagrams with a single syscall. Each item is either the
+// data itself (for connected sockets) or { data, address, port }.
+static Value socket_sendMany(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "a|n");
+
+	int    fd    = socket_fd(ths);
+	int    flags = arg.get("length").to<int>() > 1 ? arg[1].to<int>() : 0;
+	size_t cnt   = arg[0].get("length").to<size_t>();
+	if (fd < 0) return throwException(ths, EBADF);
+	if (cnt == 0) return ths.newNumber(0);
+
+	vector<UTF8>             strs(cnt);
+	vector<struct iovec>     iov(cnt);
+	vector<sockaddr_storage> addrs(cnt);
+	vector<struct mmsghdr>   msgs(cnt);
+	memset(&msgs[0], 0, sizeof(struct mmsghdr) * cnt);
+	for (size_t i=0 ; i < cnt ; i++) {
+		Value item = arg[0][i];
+		Value data = item;
+		if (binary_type(item) == BINARY_NONE && item.isObject() && !item.isArray()) {
+			data = item.get("data");
+
+			socklen_t len;
+			Value rslt = _resolve(ths, item.get("address"), item.get("port"), &addrs[i], &len);
+			if (rslt.isException()) return rslt;
+			msgs[i].msg_hdr.msg_name    = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = len;
+		}
+
+		if (!_payload(data, strs[i], &iov[i]))
+			return throwException(ths, "TypeError", "Data must be a string, ByteString or ByteArray!");
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n;
+	do {
+		n = _sendmmsg(fd, &msgs[0], cnt, flags);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
+	return ths.newNumber(n);
+}
+
+static Value socket_sendmsg(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "a|n");
+
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+
+	// Anything queued by a buffered write() must go out first
+	Stream* stream = stream_get(ths);
+	if (stream && stream_flush(stream) < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
+
+	vector<struct iovec> iov;
+	Value rslt = binary_iovec(arg[0], false, iov);
+	if (rslt.isException()) return rslt;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov.empty() ? NULL : &iov[0];
+	msg.msg_iovlen = iov.size();
+
+	ssize_t snt = sendmsg(fd, &msg, arg.get("length").to<int>() > 1 ? arg[1].to<int>() : 0);
+	if (snt < 0) return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
+	return ths.newNumber(snt);
+}
+
+#ifdef __linux__
+// Sends a file (or part of one) with sendfile(2) so the data never enters userspace
+static Value socket_sendFile(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "(sn)|nn");
+
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+
+	// Anything queued by a buffered write() must go out first
+	Stream* stream = stream_get(ths);
+	if (stream && stream_flush(stream) < 0)
+		return IO_WOULDBLOCK(errno) ? ths.newNumber(0) : throwException(ths, errno);
+
+	int in = -1;
+	if (arg[0].isString()) {
+		NATUS_CHECK_ORIGIN(ths, ("file://" + arg[0].to<UTF8>()).c_str());
+		in = open(arg[0].to<UTF8>().c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0) return throwException(ths, errno);
+	} else
+		in = arg[0].to<int>();
+
+	off_t offset = arg.get("length").to<int>() > 1 ? (off_t) arg[1].to<double>() : 0;
+	off_t remain;
+	if (arg.get("length").to<int>() > 2)
+		remain = (off_t) arg[2].to<double>();
+	else {
+		struct stat st;
+		if (fstat(in, &st) < 0) {
+			int error = errno;
+			if (arg[0].isString()) close(in);
+			return throwException(ths, error);
+		}
+		remain = st.st_size > offset ? st.st_size - offset : 0;
+	}
+
+	double total = 0;
+	while (remain > 0) {
+		ssize_t snt = sendfile(fd, in, &offset, (size_t) min(remain, (off_t) 0x7ffff000));
+		if (snt < 0 && errno == EINTR) continue;
+		if (snt < 0 && IO_WOULDBLOCK(errno)) break;
+		if (snt < 0) {
+			int error = errno;
+			if (arg[0].isString()) close(in);
+			return throwException(ths, error);
+		}
+		if (snt == 0) break; // The file is shorter than we were told
+		total  += snt;
+		remain -= snt;
+	}
+
+	if (arg[0].isString()) close(in);
+	return ths.newNumber(total);
+}
+#endif
+
 static Value socket_shutdown(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|n");
 
-	int fd = ths.getPrivate<long>(PRIV_POSIX_FD);
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
 	if (shutdown(fd, arg.get("length").to<int>() > 0 ? arg[0].to<int>() : SHUT_RDWR) < 0)
 		return throwException(ths, errno);
 	return ths.newUndefined();
 }
 
+// How an option's value is represented in JS
+enum OptionType {
+	OPT_INT,      // Number
+	OPT_BOOL,     // Boolean, stored as an int
+	OPT_LINGER,   // { l_onoff: Boolean, l_linger: seconds }
+	OPT_TIMEVAL,  // Seconds as a (fractional) Number
+	OPT_STRING,   // String, e.g. a device or congestion algorithm name
+	OPT_BYTES     // Raw ByteString; any ByteString/ByteArray when setting
+};
+
+static const struct {
+	const char* name;
+	OptionType  type;
+} opttypes[] = {
+	{ "int",     OPT_INT     },
+	{ "bool",    OPT_BOOL    },
+	{ "linger",  OPT_LINGER  },
+	{ "timeval", OPT_TIMEVAL },
+	{ "string",  OPT_STRING  },
+	{ "bytes",   OPT_BYTES   },
+};
+
+// Options whose value is not a plain int
+static const struct {
+	int        level;
+	int        name;
+	OptionType type;
+} options[] = {
+	{ SOL_SOCKET,  SO_LINGER,        OPT_LINGER  },
+	{ SOL_SOCKET,  SO_RCVTIMEO,      OPT_TIMEVAL },
+	{ SOL_SOCKET,  SO_SNDTIMEO,      OPT_TIMEVAL },
+	{ SOL_SOCKET,  SO_KEEPALIVE,     OPT_BOOL    },
+	{ SOL_SOCKET,  SO_REUSEADDR,     OPT_BOOL    },
+	{ SOL_SOCKET,  SO_BROADCAST,     OPT_BOOL    },
+	{ SOL_SOCKET,  SO_OOBINLINE,     OPT_BOOL    },
+	{ IPPROTO_TCP, TCP_NODELAY,      OPT_BOOL    },
+#ifdef __linux__
+	{ SOL_SOCKET,  SO_BINDTODEVICE,  OPT_STRING  },
+	{ IPPROTO_TCP, TCP_CORK,         OPT_BOOL    },
+	{ IPPROTO_TCP, TCP_CONGESTION,   OPT_STRING  },
+	{ IPPROTO_TCP, TCP_INFO,         OPT_BYTES   },
+#endif
+};
+
+#define SOCKOPT_MAX 256
+
+// Picks the type named by arg[index] or, without one, the option's usual type
+static Value _opttype(Value& ths, Value& arg, long index, int level, int name, OptionType* type) {
+	if (arg.get("length").to<long>() > index && !arg[index].isUndefined()) {
+		UTF8 str = arg[index].to<UTF8>();
+		for (size_t i=0 ; i < sizeof(opttypes) / sizeof(*opttypes) ; i++) {
+			if (str == opttypes[i].name) {
+				*type = opttypes[i].type;
+				return ths.newUndefined();
+			}
+		}
+		return throwException(ths, "ValueError", "Option type must be one of 'int', 'bool', 'linger', 'timeval', 'string' or 'bytes'!");
+	}
+
+	*type = OPT_INT;
+	for (size_t i=0 ; i < sizeof(options) / sizeof(*options) ; i++) {
+		if (options[i].level == level && options[i].name == name) {
+			*type = options[i].type;
+			break;
+		}
+	}
+	return ths.newUndefined();
+}
+
+// Handles getOption(level, name, [type])
+static Value socket_getOption(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nn|s");
+
+	int        fd    = socket_fd(ths);
+	int        level = arg[0].to<int>();
+	int        name  = arg[1].to<int>();
+	OptionType type;
+	if (fd < 0) return throwException(ths, EBADF);
+	Value rslt = _opttype(ths, arg, 2, level, name, &type);
+	if (rslt.isException()) return rslt;
+
+	union {
+		int            i;
+		struct linger  l;
+		struct timeval tv;
+		char           buf[SOCKOPT_MAX];
+	} val;
+	memset(&val, 0, sizeof(val));
+	socklen_t len = sizeof(val);
+	if (getsockopt(fd, level, name, &val, &len) < 0)
+		return throwException(ths, errno);
+
+	switch (type) {
+	case OPT_BOOL:
+		return ths.newBoolean(val.i != 0);
+	case OPT_LINGER: {
+		Value obj = ths.newObject();
+		obj.set("l_onoff",  val.l.l_onoff != 0);
+		obj.set("l_linger", val.l.l_linger);
+		return obj;
+	}
+	case OPT_TIMEVAL:
+		return ths.newNumber(val.tv.tv_sec + val.tv.tv_usec / 1000000.0);
+	case OPT_STRING:
+		return ths.newString(UTF8(val.buf, strnlen(val.buf, len)));
+	case OPT_BYTES: {
+		unsigned char* buf = alloc_buffer(len);
+		memcpy(buf, val.buf, len);
+		return binary_new(ths, BINARY_STRING, buf, len);
+	}
+	default:
+		return ths.newNumber(val.i);
+	}
+}
+
+// Handles setOption(level, name, value, [type])
+static Value socket_setOption(Value& fnc, Value& ths, Value& arg) {
+	NATUS_CHECK_ARGUMENTS(arg, "nn(nbsou)|s");
+
+	int        fd    = socket_fd(ths);
+	int        level = arg[0].to<int>();
+	int        name  = arg[1].to<int>();
+	Value      data  = arg[2];
+	OptionType type;
+	if (fd < 0) return throwException(ths, EBADF);
+	Value rslt = _opttype(ths, arg, 3, level, name, &type);
+	if (rslt.isException()) return rslt;
+
+	int            i;
+	struct linger  l;
+	struct timeval tv;
+	UTF8           str;
+	const void*    ptr;
+	socklen_t      len;
+	switch (type) {
+	case OPT_LINGER:
+		if (!data.isObject())
+			return throwException(ths, "TypeError", "Linger value must be an object!");
+		l.l_onoff  = data.get("l_onoff").to<bool>();
+		l.l_linger = data.get("l_linger").to<int>();
+		ptr = &l;
+		len = sizeof(l);
+		break;
+	case OPT_TIMEVAL: {
+		double secs = data.to<double>();
+		if (secs < 0)
+			return throwException(ths, "RangeError", "Timeout must not be negative!");
+		tv.tv_sec  = (time_t) secs;
+		tv.tv_usec = (suseconds_t) ((secs - tv.tv_sec) * 1000000);
+		ptr = &tv;
+		len = sizeof(tv);
+		break;
+	}
+	case OPT_STRING:
+		str = data.to<UTF8>();
+		ptr = str.c_str();
+		len = str.length();
+		break;
+	case OPT_BYTES: {
+		if (binary_type(data) == BINARY_NONE)
+			return throwException(ths, "TypeError", "Value must be a ByteString or ByteArray!");
+		size_t cnt;
+		ptr = binary_buffer(data, &cnt);
+		len = cnt;
+		break;
+	}
+	default:
+		i   = type == OPT_BOOL ? data.to<bool>() : data.to<int>();
+		ptr = &i;
+		len = sizeof(i);
+	}
+
+	if (setsockopt(fd, level, name, ptr, len) < 0)
+		return throwException(ths, errno);
+	return ths.newUndefined();
+}
+
+#if defined(__linux__) && defined(TCP_INFO)
+// The kernel's struct tcp_info; glibc's copy stops at tcpi_total_retrans.
+// Older kernels fill in less of it, so later fields are only decoded when
+// the returned length covers them.
+struct TcpInfo {
+	struct tcp_info base;
+	uint64_t tcpi_pacing_rate;
+	uint64_t tcpi_max_pacing_rate;
+	uint64_t tcpi_bytes_acked;
+	uint64_t tcpi_bytes_received;
+	uint32_t tcpi_segs_out;
+	uint32_t tcpi_segs_in;
+	uint32_t tcpi_notsent_bytes;
+	uint32_t tcpi_min_rtt;
+	uint32_t tcpi_data_segs_in;
+	uint32_t tcpi_data_segs_out;
+	uint64_t tcpi_delivery_rate;
+	uint64_t tcpi_busy_time;
+	uint64_t tcpi_rwnd_limited;
+	uint64_t tcpi_sndbuf_limited;
+	uint32_t tcpi_delivered;
+	uint32_t tcpi_delivered_ce;
+	uint64_t tcpi_bytes_sent;
+	uint64_t tcpi_bytes_retrans;
+	uint32_t tcpi_dsack_dups;
+	uint32_t tcpi_reord_seen;
+};
+
+#define TCPI(field)     info.set(# field, (double) ti.base.field)
+#define TCPI_EXT(field) if (len >= offsetof(TcpInfo, field) + sizeof(ti.field)) info.set(# field, (double) ti.field)
+
+// Returns the connection's TCP_INFO statistics (times in microseconds)
+static Value socket_tcpInfo(Value& fnc, Value& ths, Value& arg) {
+	int fd = socket_fd(ths);
+	if (fd < 0) return throwException(ths, EBADF);
+
+	TcpInfo ti;
+	memset(&ti, 0, sizeof(ti));
+	socklen_t len = sizeof(ti);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return throwException(ths, errno);
+
+	Value info = ths.newObject();
+	if (info.isException()) return info;
+	TCPI(tcpi_state);
+	TCPI(tcpi_ca_state);
+	TCPI(tcpi_retransmits);
+	TCPI(tcpi_probes);
+	TCPI(tcpi_backoff);
+	TCPI(tcpi_options);
+	TCPI(tcpi_snd_wscale);
+	TCPI(tcpi_rcv_wscale);
+	TCPI(tcpi_rto);
+	TCPI(tcpi_ato);
+	TCPI(tcpi_snd_mss);
+	TCPI(tcpi_rcv_mss);
+	TCPI(tcpi_unacked);
+	TCPI(tcpi_sacked);
+	TCPI(tcpi_lost);
+	TCPI(tcpi_retrans);
+	TCPI(tcpi_fackets);
+	TCPI(tcpi_last_data_sent);
+	TCPI(tcpi_last_data_recv);
+	TCPI(tcpi_last_ack_recv);
+	TCPI(tcpi_pmtu);
+	TCPI(tcpi_rcv_ssthresh);
+	TCPI(tcpi_rtt);
+	TCPI(tcpi_rttvar);
+	TCPI(tcpi_snd_ssthresh);
+	TCPI(tcpi_snd_cwnd);
+	TCPI(tcpi_advmss);
+	TCPI(tcpi_reordering);
+	TCPI(tcpi_rcv_rtt);
+	TCPI(tcpi_rcv_space);
+	TCPI(tcpi_total_retrans);
+	TCPI_EXT(tcpi_pacing_rate);
+	TCPI_EXT(tcpi_max_pacing_rate);
+	TCPI_EXT(tcpi_bytes_acked);
+	TCPI_EXT(tcpi_bytes_received);
+	TCPI_EXT(tcpi_segs_out);
+	TCPI_EXT(tcpi_segs_in);
+	TCPI_EXT(tcpi_notsent_bytes);
+	TCPI_EXT(tcpi_min_rtt);
+	TCPI_EXT(tcpi_data_segs_in);
+	TCPI_EXT(tcpi_data_segs_out);
+	TCPI_EXT(tcpi_delivery_rate);
+	TCPI_EXT(tcpi_busy_time);
+	TCPI_EXT(tcpi_rwnd_limited);
+	TCPI_EXT(tcpi_sndbuf_limited);
+	TCPI_EXT(tcpi_delivered);
+	TCPI_EXT(tcpi_delivered_ce);
+	TCPI_EXT(tcpi_bytes_sent);
+	TCPI_EXT(tcpi_bytes_retrans);
+	TCPI_EXT(tcpi_dsack_dups);
+	TCPI_EXT(tcpi_reord_seen);
+	return info;
+}
+#endif
+
 static Value socket_ctor(Value& fnc, Value& ths, Value& arg) {
 	NATUS_CHECK_ARGUMENTS(arg, "|nnn");
 
@@ -187,28 +944,22 @@ static Value socket_ctor(Value& fnc, Value& ths, Value& arg) {
 
 	int fd = socket(domain, type, prot);
 	if (fd < 0) return throwException(ths, errno);
-	return socket_from_sock(ths, fd, domain, type, prot);
+	return socket_from_sock(ths, fnc.get("prototype"), fd, domain, type, prot);
 }
 
-static Value socket_from_sock(Value& ctx, int sock, int domain, int type, int protocol) {
+static Value socket_from_sock(Value& ctx, const Value& proto, int sock, int domain, int type, int protocol) {
 	Value obj = ctx.newObject(new SocketClass);
 	if (obj.isException()) return obj;
-	stream_from_fd(obj, sock);
 
-	obj.set("accept",        socket_accept);
-	obj.set("bind",          socket_bind);
-	obj.set("connect",       socket_connect);
-	obj.set("listen",        socket_listen);
-	obj.set("receive",       socket_receive);
-	obj.set("recv",          socket_receive);
-	obj.set("send",          socket_send);
-	obj.set("shutdown",      socket_shutdown);
-	obj.set("isConnected",   false);
-	obj.set("isReadable",    false);
-	obj.set("isWritable",    false);
-	obj.set("domain",        domain);
-	obj.set("type",          type);
-	obj.set("protocol",      protocol);
+	SocketInfo* info = new SocketInfo;
+	info->domain   = domain;
+	info->type     = type;
+	info->protocol = protocol;
+	obj.setPrivate(PRIV_SOCKET_INFO, info, (FreeFunction) socket_info_free);
+
+	// Methods live on Socket.prototype; the instance only carries its state
+	obj.set("__proto__", proto);
+	stream_from_fd(obj, sock);
 	return obj;
 }
 
@@ -221,6 +972,34 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 
 	// Objects
 	OK(mod.setRecursive("exports.Socket", socket_ctor));
+	OK(mod.setRecursive("exports.Socket.prototype.accept",     socket_accept));
+	OK(mod.setRecursive("exports.Socket.prototype.acceptMany", socket_acceptMany));
+	OK(mod.setRecursive("exports.Socket.prototype.bind",       socket_bind));
+	OK(mod.setRecursive("exports.Socket.prototype.connect",    socket_connect));
+	OK(mod.setRecursive("exports.Socket.prototype.getOption",  socket_getOption));
+	OK(mod.setRecursive("exports.Socket.prototype.listen",     socket_listen));
+	OK(mod.setRecursive("exports.Socket.prototype.receive",    socket_receive));
+	OK(mod.setRecursive("exports.Socket.prototype.recv",       socket_receive));
+	OK(mod.setRecursive("exports.Socket.prototype.recvFrom",   socket_recvFrom));
+	OK(mod.setRecursive("exports.Socket.prototype.recvInto",   socket_recvInto));
+	OK(mod.setRecursive("exports.Socket.prototype.recvMany",   socket_recvMany));
+	OK(mod.setRecursive("exports.Socket.prototype.recvmsg",    socket_recvmsg));
+	OK(mod.setRecursive("exports.Socket.prototype.send",       socket_send));
+	OK(mod.setRecursive("exports.Socket.prototype.sendMany",   socket_sendMany));
+	OK(mod.setRecursive("exports.Socket.prototype.sendTo",     socket_sendTo));
+	OK(mod.setRecursive("exports.Socket.prototype.sendmsg",    socket_sendmsg));
+	OK(mod.setRecursive("exports.Socket.prototype.setOption",  socket_setOption));
+#ifdef __linux__
+	OK(mod.setRecursive("exports.Socket.prototype.sendFile",   socket_sendFile));
+#endif
+	OK(mod.setRecursive("exports.Socket.prototype.shutdown",   socket_shutdown));
+#if defined(__linux__) && defined(TCP_INFO)
+	OK(mod.setRecursive("exports.Socket.prototype.tcpInfo",    socket_tcpInfo));
+#endif
+
+	// Sockets are streams too
+	Value proto = mod.get("exports").get("Socket").get("prototype");
+	ok = stream_prototype(proto) || ok;
 
 	// Constants
 #ifdef AF_APPLETALK
@@ -460,6 +1239,12 @@ extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 #ifdef SO_RXQ_OVFL
 	NCONST(SO_RXQ_OVFL);
 #endif
+#ifdef TCP_NODELAY
+	NCONST(TCP_NODELAY);
+#endif
+#ifdef TCP_MAXSEG
+	NCONST(TCP_MAXSEG);
+#endif
 #ifdef TCP_CORK
 	NCONST(TCP_CORK);
 #endif
@@ -80,11 +80,17 @@ public:
 extern "C" bool NATUS_MODULE_INIT(ntValue* module) {
 	Value base(module, false);
 
+	// The standard streams share one set of methods
+	Value proto   = base.newObject();
 	Value ostdin  = base.newObject();
 	Value ostdout = base.newObject();
 	Value ostderr = base.newObject();
+	stream_prototype(proto);
+	ostdin.set("__proto__",  proto);
+	ostdout.set("__proto__", proto);
+	ostderr.set("__proto__", proto);
 	stream_from_fd(ostdin,  STDIN_FILENO);
-	stream_from_fd(ostdout, STDOUT_FILENO);
+	stream_from_fd(ostdout, STDOUT_FILENO, isatty(STDOUT_FILENO) ? STREAM_LINE_BUFFERED : STREAM_FULLY_BUFFERED);
 	stream_from_fd(ostderr, STDERR_FILENO);
 
 	bool ok = !base.setRecursive("exports.args", base.newArray()).isException();